@@ -0,0 +1,687 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#include "./bam.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+using std::atomic;
+
+#include <sstream>
+using std::istringstream;
+
+#include <string>
+using std::string;
+
+#include <vector>
+using std::vector;
+
+#include "./util.h"
+#include "./error.h"
+using paa::Error;
+
+namespace {
+
+// BGZF limits a block to 64 KB, so input is cut to leave room for
+// incompressible data and the 26 bytes of header and footer
+const uint64_t block_input = 0xff00;
+const uint64_t block_output = 0x10000;
+const uint64_t batch_blocks = 256;
+
+// Header of a BGZF block, with the block size (BSIZE) at 16
+const unsigned char block_header[18] = {
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 0, 0};
+// An empty block marks the end of a BGZF file
+const unsigned char end_block[28] = {
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0,
+  3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+template <class T>
+void put(vector<char> & out, const T value) {
+  const char * bytes = reinterpret_cast<const char *>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template <class T>
+void put_at(vector<char> & out, const uint64_t position, const T value) {
+  memcpy(&out[position], &value, sizeof(T));
+}
+
+// BAM 4-bit base codes
+static const class BaseCodes {
+ public:
+  BaseCodes() {
+    for (unsigned int c = 0; c != 256; ++c) codes[c] = 15;
+    const string bases = "=ACMGRSVTWYHKDBN";
+    for (unsigned int b = 0; b != bases.size(); ++b) {
+      codes[static_cast<unsigned char>(bases[b])] = b;
+      codes[static_cast<unsigned char>(tolower(bases[b]))] = b;
+    }
+  }
+  unsigned char operator[](const char c) const {
+    return codes[static_cast<unsigned char>(c)];
+  }
+
+ private:
+  unsigned char codes[256];
+} base_codes;
+
+// CIGAR operation codes, and whether each consumes the reference
+int cigar_op(const char c) {
+  const char * const ops = "MIDNSHP=X";
+  const char * const op = strchr(ops, c);
+  if (c == '\0' || op == nullptr) throw Error("bad CIGAR operation") << c;
+  return op - ops;
+}
+bool consumes_reference(const int op) {
+  return op == 0 || op == 2 || op == 3 || op == 7 || op == 8;
+}
+
+// Smallest bin containing [begin, end), from the SAM specification
+uint16_t reg2bin(const int64_t begin, int64_t end) {
+  --end;
+  if (begin >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (begin >> 14);
+  if (begin >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (begin >> 17);
+  if (begin >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (begin >> 20);
+  if (begin >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (begin >> 23);
+  if (begin >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (begin >> 26);
+  return 0;
+}
+
+// Integers are stored in the smallest type that holds them
+void put_integer(vector<char> & out, const int64_t value) {
+  if (value < 0) {
+    if (value >= -128) {
+      out.push_back('c');
+      put<int8_t>(out, value);
+    } else if (value >= -32768) {
+      out.push_back('s');
+      put<int16_t>(out, value);
+    } else {
+      out.push_back('i');
+      put<int32_t>(out, value);
+    }
+  } else {
+    if (value <= 255) {
+      out.push_back('C');
+      put<uint8_t>(out, value);
+    } else if (value <= 65535) {
+      out.push_back('S');
+      put<uint16_t>(out, value);
+    } else {
+      out.push_back('I');
+      put<uint32_t>(out, value);
+    }
+  }
+}
+
+void put_array_value(vector<char> & out, const char type,
+                     const char * & value) {
+  char * end;
+  switch (type) {
+    case 'c': put<int8_t>(out, strtol(value, &end, 10)); break;
+    case 'C': put<uint8_t>(out, strtoul(value, &end, 10)); break;
+    case 's': put<int16_t>(out, strtol(value, &end, 10)); break;
+    case 'S': put<uint16_t>(out, strtoul(value, &end, 10)); break;
+    case 'i': put<int32_t>(out, strtol(value, &end, 10)); break;
+    case 'I': put<uint32_t>(out, strtoul(value, &end, 10)); break;
+    case 'f': put<float>(out, strtof(value, &end)); break;
+    default: throw Error("bad B array type") << type;
+  }
+  value = end;
+}
+
+void deflate_block(z_stream & stream, const char * input,
+                   const uint64_t length, vector<char> & block) {
+  block.resize(block_output);
+  if (deflateReset(&stream) != Z_OK) throw Error("deflate reset error");
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+  stream.avail_in = length;
+  stream.next_out = reinterpret_cast<Bytef *>(&block[sizeof(block_header)]);
+  stream.avail_out = block_output - sizeof(block_header) - 8;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    throw Error("BGZF block did not fit in 64 KB");
+  const uint64_t size = block_output - stream.avail_out;
+  memcpy(&block[0], block_header, sizeof(block_header));
+  put_at<uint16_t>(block, 16, size - 1);
+  put_at<uint32_t>(block, size - 8, crc32(
+      crc32(0, nullptr, 0), reinterpret_cast<const Bytef *>(input), length));
+  put_at<uint32_t>(block, size - 4, length);
+  block.resize(size);
+}
+
+template <class T>
+T get(const char * & in) {
+  T value;
+  memcpy(&value, in, sizeof(T));
+  in += sizeof(T);
+  return value;
+}
+
+void append_integer(string & out, const int64_t value) {
+  char text[24];
+  out.append(text, snprintf(text, sizeof(text), "%" PRId64, value));
+}
+
+void append_float(string & out, const float value) {
+  char text[32];
+  out.append(text, snprintf(text, sizeof(text), "%g",
+                            static_cast<double>(value)));
+}
+
+// Bytes in a value of BAM type code type
+uint64_t value_size(const char type) {
+  switch (type) {
+    case 'c': case 'C': return 1;
+    case 's': case 'S': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    default: throw Error("bad BAM value type") << type;
+  }
+}
+
+// Appends an integer or float of BAM type code type, checking it is
+// before end
+void append_value(string & out, const char type, const char * & in,
+                  const char * const end) {
+  if (static_cast<uint64_t>(end - in) < value_size(type))
+    throw Error("BAM value runs past its record");
+  switch (type) {
+    case 'c': append_integer(out, get<int8_t>(in)); break;
+    case 'C': append_integer(out, get<uint8_t>(in)); break;
+    case 's': append_integer(out, get<int16_t>(in)); break;
+    case 'S': append_integer(out, get<uint16_t>(in)); break;
+    case 'i': append_integer(out, get<int32_t>(in)); break;
+    case 'I': append_integer(out, get<uint32_t>(in)); break;
+    case 'f': append_float(out, get<float>(in)); break;
+    default: throw Error("bad BAM value type") << type;
+  }
+}
+
+// One thread per core, shared by all writers, which take turns
+ThreadPool & compression_pool() {
+  static ThreadPool pool(n_cores());
+  return pool;
+}
+
+}  // namespace
+
+BamWriter::BamWriter(const string & file_name_, const string & sam_header)
+    : file_name(file_name_), out(fopen(file_name.c_str(), "wb")) {
+  if (out == nullptr)
+    throw Error("could not open BAM output") << file_name << "for writing";
+  vector<string> names;
+  vector<uint32_t> lengths;
+  istringstream header(sam_header);
+  string line;
+  while (getline(header, line)) {
+    if (line.compare(0, 4, "@SQ\t")) continue;
+    const uint64_t name_start = line.find("\tSN:");
+    const uint64_t length_start = line.find("\tLN:");
+    if (name_start == string::npos || length_start == string::npos)
+      throw Error("@SQ header line needs SN and LN") << line;
+    const uint64_t name_end = line.find('\t', name_start + 4);
+    names.push_back(line.substr(name_start + 4, name_end == string::npos ?
+                                string::npos : name_end - name_start - 4));
+    lengths.push_back(atol(line.c_str() + length_start + 4));
+    references[names.back()] = static_cast<int32_t>(names.size() - 1);
+  }
+  const char magic[4] = {'B', 'A', 'M', 1};
+  data.insert(data.end(), magic, magic + 4);
+  put<int32_t>(data, sam_header.size());
+  data.insert(data.end(), sam_header.begin(), sam_header.end());
+  put<int32_t>(data, names.size());
+  for (uint64_t r = 0; r != names.size(); ++r) {
+    put<int32_t>(data, names[r].size() + 1);
+    data.insert(data.end(), names[r].c_str(),
+                names[r].c_str() + names[r].size() + 1);
+    put<uint32_t>(data, lengths[r]);
+  }
+  // Records start in a new block
+  compress(true);
+}
+
+BamWriter::~BamWriter() {
+  if (out != nullptr) fclose(out);
+}
+
+int32_t BamWriter::reference(const char * name, const char * end) {
+  if (end - name == 1 && *name == '*') return -1;
+  name_buffer.assign(name, end);
+  const std::unordered_map<string, int32_t>::const_iterator found =
+      references.find(name_buffer);
+  if (found == references.end())
+    throw Error("reference is not in the BAM header") << name_buffer;
+  return found->second;
+}
+
+void BamRecord::start(const char * name, const uint64_t name_length,
+                      const uint16_t flag, const int32_t ref_id,
+                      const int32_t pos, const uint8_t mapq,
+                      const char * cigar, const char * cigar_end,
+                      const int32_t next_ref_id, const int32_t next_pos,
+                      const int32_t template_length,
+                      const char * bases, const uint64_t n_bases,
+                      const char * qualities, const bool reverse_qualities) {
+  if (name_length > 254) {
+    const string text(name, name_length);
+    throw Error("read name too long for BAM") << text;
+  }
+  // Fixed length part of the record, with its size, bin and CIGAR length
+  // filled in once the CIGAR is read
+  bytes.clear();
+  put<int32_t>(bytes, 0);
+  put<int32_t>(bytes, ref_id);
+  put<int32_t>(bytes, pos);
+  put<uint8_t>(bytes, name_length + 1);
+  put<uint8_t>(bytes, mapq);
+  put<uint16_t>(bytes, 0);
+  put<uint16_t>(bytes, 0);
+  put<uint16_t>(bytes, flag);
+  put<int32_t>(bytes, n_bases);
+  put<int32_t>(bytes, next_ref_id);
+  put<int32_t>(bytes, next_pos);
+  put<int32_t>(bytes, template_length);
+
+  // Variable length part
+  bytes.insert(bytes.end(), name, name + name_length);
+  bytes.push_back('\0');
+  uint64_t n_cigar = 0;
+  uint64_t ref_length = 0;
+  if (*cigar != '*') {
+    const char * op = cigar;
+    while (op != cigar_end) {
+      char * op_end;
+      const uint32_t length = strtoul(op, &op_end, 10);
+      const int code = cigar_op(*op_end);
+      if (consumes_reference(code)) ref_length += length;
+      put<uint32_t>(bytes, length << 4 | code);
+      ++n_cigar;
+      op = op_end + 1;
+    }
+  }
+  put_at<uint16_t>(bytes, 14, reg2bin(
+      pos, pos + std::max<uint64_t>(ref_length, 1)));
+  put_at<uint16_t>(bytes, 16, n_cigar);
+  for (uint64_t b = 0; b < n_bases; b += 2)
+    bytes.push_back(base_codes[bases[b]] << 4 |
+                    (b + 1 < n_bases ? base_codes[bases[b + 1]] : 0));
+  if (qualities == nullptr) {
+    bytes.insert(bytes.end(), n_bases, '\xff');
+  } else if (reverse_qualities) {
+    for (uint64_t q = n_bases; q; --q) bytes.push_back(qualities[q - 1] - 33);
+  } else {
+    for (uint64_t q = 0; q != n_bases; ++q) bytes.push_back(qualities[q] - 33);
+  }
+}
+
+void BamRecord::add_integer(const char * tag, const int64_t value) {
+  bytes.insert(bytes.end(), tag, tag + 2);
+  put_integer(bytes, value);
+}
+
+void BamRecord::add_char(const char * tag, const char value) {
+  bytes.insert(bytes.end(), tag, tag + 2);
+  bytes.push_back('A');
+  bytes.push_back(value);
+}
+
+void BamRecord::add_string(const char * tag, const char * value,
+                           const uint64_t length) {
+  bytes.insert(bytes.end(), tag, tag + 2);
+  bytes.push_back('Z');
+  bytes.insert(bytes.end(), value, value + length);
+  bytes.push_back('\0');
+}
+
+void BamRecord::add_sam_tags(const char * text, const char * end) {
+  const char * c = text;
+  while (c != end && *c == '\t') {
+    const char * const tag = ++c;
+    while (c != end && *c != '\t' && *c != '\n' && *c != '\0') ++c;
+    add_sam_tag(tag, c);
+  }
+}
+
+// Tags are TG:T:value
+void BamRecord::add_sam_tag(const char * tag, const char * end) {
+  if (end - tag < 5 || tag[2] != ':' || tag[4] != ':') {
+    const string text(tag, end);
+    throw Error("bad SAM tag") << text;
+  }
+  bytes.insert(bytes.end(), tag, tag + 2);
+  const char type = tag[3];
+  const char * value = tag + 5;
+  switch (type) {
+    case 'A':
+      bytes.push_back('A');
+      bytes.push_back(*value);
+      break;
+    case 'i':
+      put_integer(bytes, strtoll(value, nullptr, 10));
+      break;
+    case 'f':
+      bytes.push_back('f');
+      put<float>(bytes, strtof(value, nullptr));
+      break;
+    case 'Z':
+    case 'H':
+      bytes.push_back(type);
+      bytes.insert(bytes.end(), value, end);
+      bytes.push_back('\0');
+      break;
+    case 'B':
+      {
+        bytes.push_back('B');
+        const char array_type = *value++;
+        bytes.push_back(array_type);
+        const uint64_t count_position = bytes.size();
+        put<int32_t>(bytes, 0);
+        int32_t count = 0;
+        while (value != end && *value == ',') {
+          ++value;
+          put_array_value(bytes, array_type, value);
+          ++count;
+        }
+        put_at<int32_t>(bytes, count_position, count);
+      }
+      break;
+    default:
+      {
+        const string text(tag, end);
+        throw Error("unknown SAM tag type") << text;
+      }
+  }
+}
+
+const char * BamRecord::data() {
+  put_at<int32_t>(bytes, 0, bytes.size() - 4);
+  return bytes.data();
+}
+
+BamKey::BamKey(const char * record, const uint64_t position_)
+    : position(position_), name_prefix(0), data(record) {
+  const char * name = data + 36;
+  for (unsigned int c = 0; c != 8; ++c) {
+    name_prefix <<= 8;
+    if (*name) name_prefix |= static_cast<unsigned char>(*name++);
+  }
+}
+
+// Full names, then first / second of pair and strand
+bool BamKey::tie_break(const BamKey & right) const {
+  const int names = strcmp(data + 36, right.data + 36);
+  if (names) return names < 0;
+  const uint16_t mask = 64 | 128 | 16;
+  uint16_t flag;
+  uint16_t right_flag;
+  memcpy(&flag, data + 18, sizeof(flag));
+  memcpy(&right_flag, right.data + 18, sizeof(right_flag));
+  flag &= mask;
+  right_flag &= mask;
+  if (flag == right_flag) {
+    const string name(data + 36);
+    throw Error("flags equal for") << name;
+  }
+  return flag < right_flag;
+}
+
+void BamWriter::add_record(const char * encoded) {
+  int32_t size;
+  memcpy(&size, encoded, sizeof(size));
+  data.insert(data.end(), encoded, encoded + size + 4);
+  if (data.size() >= batch_blocks * block_input) compress(false);
+}
+
+void BamWriter::add(const char * line) {
+  // Mandatory fields
+  const unsigned int n_fields = 11;
+  const char * fields[n_fields];
+  const char * ends[n_fields];
+  const char * c = line;
+  for (unsigned int f = 0; f != n_fields; ++f) {
+    fields[f] = c;
+    while (*c != '\t' && *c != '\n' && *c != '\0') ++c;
+    ends[f] = c;
+    if (f + 1 != n_fields) {
+      if (*c != '\t') throw Error("SAM line has too few fields") << line;
+      ++c;
+    }
+  }
+  const int32_t ref_id = reference(fields[2], ends[2]);
+  const int32_t next_ref_id = ends[6] - fields[6] == 1 && *fields[6] == '=' ?
+      ref_id : reference(fields[6], ends[6]);
+  const bool no_bases = ends[9] - fields[9] == 1 && *fields[9] == '*';
+  const uint64_t n_bases = no_bases ? 0 : ends[9] - fields[9];
+  const bool no_qualities = ends[10] - fields[10] == 1 && *fields[10] == '*';
+  if (!no_qualities && static_cast<uint64_t>(ends[10] - fields[10]) != n_bases)
+    throw Error("SAM qualities and bases differ in length") << line;
+  record.start(fields[0], ends[0] - fields[0],
+               strtoul(fields[1], nullptr, 10), ref_id,
+               strtol(fields[3], nullptr, 10) - 1,
+               strtoul(fields[4], nullptr, 10), fields[5], ends[5],
+               next_ref_id, strtol(fields[7], nullptr, 10) - 1,
+               strtol(fields[8], nullptr, 10),
+               fields[9], n_bases, no_qualities ? nullptr : fields[10]);
+  const char * tags_end = c;
+  while (*tags_end != '\n' && *tags_end != '\0') ++tags_end;
+  record.add_sam_tags(c, tags_end);
+  add_record(record.data());
+}
+
+// Whole blocks (and a final part block) are compressed in parallel
+void BamWriter::compress(const bool final) {
+  const uint64_t n_blocks =
+      (data.size() + (final ? block_input - 1 : 0)) / block_input;
+  if (n_blocks == 0) return;
+  if (blocks.size() < n_blocks) blocks.resize(n_blocks);
+  atomic<uint64_t> next_block(0);
+  ThreadPool & pool = compression_pool();
+  pool.run(std::min<uint64_t>(pool.size(), n_blocks), [&](uint64_t) {
+      z_stream stream;
+      stream.zalloc = nullptr;
+      stream.zfree = nullptr;
+      stream.opaque = nullptr;
+      if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Error("deflate init error for") << file_name;
+      try {
+        uint64_t b;
+        while ((b = next_block++) < n_blocks) {
+          const uint64_t offset = b * block_input;
+          deflate_block(stream, &data[offset], std::min(
+              block_input, data.size() - offset), blocks[b]);
+        }
+      } catch (...) {
+        deflateEnd(&stream);
+        throw;
+      }
+      deflateEnd(&stream);
+    });
+  for (uint64_t b = 0; b != n_blocks; ++b)
+    if (fwrite(blocks[b].data(), 1, blocks[b].size(), out) !=
+        blocks[b].size())
+      throw Error("problem writing BAM output") << file_name;
+  data.erase(data.begin(), data.begin() +
+             std::min<uint64_t>(data.size(), n_blocks * block_input));
+}
+
+void BamWriter::close() {
+  compress(true);
+  if (fwrite(end_block, 1, sizeof(end_block), out) != sizeof(end_block))
+    throw Error("problem writing BAM output") << file_name;
+  if (fclose(out)) throw Error("problem closing BAM output") << file_name;
+  out = nullptr;
+}
+
+BamReader::BamReader(const string & file_name_)
+    : file_name(file_name_), input(gzopen(file_name.c_str(), "rb")) {
+  if (input == nullptr) throw Error("could not open BAM input") << file_name;
+  gzbuffer(input, 1 << 20);
+  char magic[4];
+  read(magic, 4);
+  if (memcmp(magic, "BAM\1", 4)) throw Error("not a BAM file") << file_name;
+  int32_t length;
+  read(&length, sizeof(length));
+  header_text.resize(length);
+  if (length) read(&header_text[0], length);
+  // Text may be padded with nulls
+  header_text.resize(strlen(header_text.c_str()));
+  int32_t n_references;
+  read(&n_references, sizeof(n_references));
+  for (int32_t r = 0; r != n_references; ++r) {
+    read(&length, sizeof(length));
+    vector<char> name(length);
+    read(name.data(), length);
+    names.push_back(name.data());
+    uint32_t reference_length;
+    read(&reference_length, sizeof(reference_length));
+  }
+}
+
+BamReader::~BamReader() {
+  gzclose(input);
+}
+
+bool BamReader::read(void * out, const uint64_t size, const bool end_ok) {
+  const int n_read = gzread(input, out, size);
+  if (n_read == 0 && end_ok) return false;
+  if (n_read < 0 || static_cast<uint64_t>(n_read) != size)
+    throw Error("truncated or bad BAM input") << file_name;
+  return true;
+}
+
+const string & BamReader::reference(const int32_t id) const {
+  static const string none = "*";
+  if (id == -1) return none;
+  if (id < 0 || static_cast<uint64_t>(id) >= names.size())
+    throw Error("bad BAM reference id in") << file_name;
+  return names[id];
+}
+
+bool BamReader::next(string & line) {
+  int32_t size;
+  if (!read(&size, sizeof(size), true)) return false;
+  if (size < 32) throw Error("bad BAM record size in") << file_name;
+  record.resize(size);
+  read(record.data(), size);
+  const char * in = record.data();
+  const char * const end = in + size;
+  const int32_t ref_id = get<int32_t>(in);
+  const int32_t pos = get<int32_t>(in);
+  const uint8_t name_length = get<uint8_t>(in);
+  const uint8_t mapq = get<uint8_t>(in);
+  get<uint16_t>(in);  // bin
+  const uint16_t n_cigar = get<uint16_t>(in);
+  const uint16_t flag = get<uint16_t>(in);
+  const int32_t n_bases = get<int32_t>(in);
+  const int32_t next_ref_id = get<int32_t>(in);
+  const int32_t next_pos = get<int32_t>(in);
+  const int32_t template_length = get<int32_t>(in);
+  if (in + name_length + 4 * n_cigar + (n_bases + 1) / 2 + n_bases > end)
+    throw Error("bad BAM record in") << file_name;
+
+  line.clear();
+  line.append(in, name_length ? name_length - 1 : 0);
+  in += name_length;
+  line += '\t';
+  append_integer(line, flag);
+  line += '\t';
+  line += reference(ref_id);
+  line += '\t';
+  append_integer(line, pos + 1);
+  line += '\t';
+  append_integer(line, mapq);
+  line += '\t';
+  if (n_cigar) {
+    for (uint16_t c = 0; c != n_cigar; ++c) {
+      const uint32_t op = get<uint32_t>(in);
+      if ((op & 15) > 8) throw Error("bad BAM CIGAR operation in") << file_name;
+      append_integer(line, op >> 4);
+      line += "MIDNSHP=X"[op & 15];
+    }
+  } else {
+    line += '*';
+  }
+  line += '\t';
+  line += reference(next_ref_id);
+  line += '\t';
+  append_integer(line, next_pos + 1);
+  line += '\t';
+  append_integer(line, template_length);
+  line += '\t';
+  if (n_bases) {
+    const char * const bases = "=ACMGRSVTWYHKDBN";
+    for (int32_t b = 0; b != n_bases; ++b)
+      line += bases[(static_cast<unsigned char>(in[b / 2]) >>
+                     (b % 2 ? 0 : 4)) & 15];
+  } else {
+    line += '*';
+  }
+  in += (n_bases + 1) / 2;
+  line += '\t';
+  if (n_bases == 0 || static_cast<unsigned char>(*in) == 0xff) {
+    line += '*';
+  } else {
+    for (int32_t q = 0; q != n_bases; ++q) line += static_cast<char>(in[q] + 33);
+  }
+  in += n_bases;
+
+  // Tags are TG, a type and a value
+  while (in != end) {
+    if (end - in < 4) throw Error("bad BAM tag in") << file_name;
+    line += '\t';
+    line.append(in, 2);
+    in += 2;
+    const char type = *in++;
+    switch (type) {
+      case 'A':
+        line += ":A:";
+        line += *in++;
+        break;
+      case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+        line += ":i:";
+        append_value(line, type, in, end);
+        break;
+      case 'f':
+        line += ":f:";
+        append_value(line, type, in, end);
+        break;
+      case 'Z':
+      case 'H':
+        {
+          const char * const value_end =
+              static_cast<const char *>(memchr(in, '\0', end - in));
+          if (value_end == nullptr) throw Error("bad BAM tag in") << file_name;
+          line += ':';
+          line += type;
+          line += ':';
+          line.append(in, value_end);
+          in = value_end + 1;
+        }
+        break;
+      case 'B':
+        {
+          if (end - in < 5) throw Error("bad BAM tag in") << file_name;
+          const char array_type = *in++;
+          const int32_t count = get<int32_t>(in);
+          line += ":B:";
+          line += array_type;
+          for (int32_t v = 0; v != count; ++v) {
+            line += ',';
+            append_value(line, array_type, in, end);
+          }
+        }
+        break;
+      default:
+        throw Error("unknown BAM tag type") << type << "in" << file_name;
+    }
+    if (in > end) throw Error("bad BAM tag in") << file_name;
+  }
+  line += '\n';
+  return true;
+}
@@ -0,0 +1,128 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#ifndef LONGMEM_BAM_H_
+#define LONGMEM_BAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One BAM record, encoded from its fields by code that has them, so
+// that no SAM text is formatted and parsed again.  Reference ids are the
+// order of the @SQ header lines, -1 for none.
+class BamRecord {
+ public:
+  // Fixed fields, read name, CIGAR and sequence.  cigar is CIGAR text,
+  // or * for none.  qualities are Phred+33 text, or nullptr for none,
+  // and are written in reverse if reverse_qualities.
+  void start(const char * name, const uint64_t name_length,
+             const uint16_t flag, const int32_t ref_id, const int32_t pos,
+             const uint8_t mapq, const char * cigar, const char * cigar_end,
+             const int32_t next_ref_id, const int32_t next_pos,
+             const int32_t template_length,
+             const char * bases, const uint64_t n_bases,
+             const char * qualities, const bool reverse_qualities = false);
+  // Tags, with tag the two character name
+  void add_integer(const char * tag, const int64_t value);
+  void add_char(const char * tag, const char value);
+  void add_string(const char * tag, const char * value,
+                  const uint64_t length);
+  // SAM text tags, each TG:T:value preceded by a tab
+  void add_sam_tags(const char * text, const char * end);
+  // Record with its block size filled in
+  const char * data();
+  uint64_t size() const { return bytes.size(); }
+
+ private:
+  void add_sam_tag(const char * tag, const char * end);
+  std::vector<char> bytes;
+};
+
+// Sort key of an encoded BAM record, ordered like SamKey for the same
+// record as SAM text: by absolute position, then read name, then mate
+// and strand flags
+class BamKey {
+ public:
+  BamKey() : position(0), name_prefix(0), data(nullptr) {}
+  // position is the chromosome offset plus the one based position
+  BamKey(const char * record, const uint64_t position_);
+  bool operator<(const BamKey & right) const {
+    if (position != right.position) return position < right.position;
+    if (name_prefix != right.name_prefix)
+      return name_prefix < right.name_prefix;
+    return tie_break(right);
+  }
+  bool same_prefix(const BamKey & right) const {
+    return position == right.position && name_prefix == right.name_prefix;
+  }
+
+  uint64_t position;  // absolute position
+  uint64_t name_prefix;  // first eight name characters, big endian
+  const char * data;  // the record
+
+ private:
+  bool tie_break(const BamKey & right) const;
+};
+
+// Writes a BAM file from encoded records or SAM text lines.  Records are
+// added to a buffer, which is cut into BGZF blocks that are compressed
+// on a thread pool shared by all writers and written in order.
+class BamWriter {
+ public:
+  // Reference names and lengths are taken from the @SQ header lines
+  BamWriter(const std::string & file_name_, const std::string & sam_header);
+  ~BamWriter();
+
+  // One record from BamRecord::data
+  void add_record(const char * encoded);
+  // One SAM line, with or without its newline
+  void add(const char * line);
+  // Compresses what is left and writes the end of file block
+  void close();
+
+ private:
+  void compress(const bool final);
+  int32_t reference(const char * name, const char * end);
+
+  std::string file_name;
+  FILE * out;
+  std::vector<char> data;  // uncompressed BAM not yet in a block
+  std::vector<std::vector<char> > blocks;  // compressed blocks in order
+  std::unordered_map<std::string, int32_t> references;
+  std::string name_buffer;
+  BamRecord record;  // for SAM lines
+  BamWriter(const BamWriter & disabled_copy_constructor);
+  BamWriter & operator=(const BamWriter & disabled_assignment_operator);
+};
+
+// Reads a BAM file back as SAM text lines.  A mate reference equal to
+// the reference is written as its name, not as =.
+class BamReader {
+ public:
+  explicit BamReader(const std::string & file_name_);
+  ~BamReader();
+
+  // SAM header text, as given to BamWriter
+  const std::string & header() const { return header_text; }
+  // Next record as a SAM line with its newline, or false at end
+  bool next(std::string & line);
+
+ private:
+  // Reads exactly size bytes, returning false only at a clean end
+  bool read(void * out, const uint64_t size, const bool end_ok = false);
+  const std::string & reference(const int32_t id) const;
+
+  std::string file_name;
+  gzFile input;
+  std::string header_text;
+  std::vector<std::string> names;
+  std::vector<char> record;
+  BamReader(const BamReader & disabled_copy_constructor);
+  BamReader & operator=(const BamReader & disabled_assignment_operator);
+};
+
+#endif  // LONGMEM_BAM_H_
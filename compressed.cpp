@@ -0,0 +1,214 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#include "./compressed.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#include "./util.h"
+#include "./error.h"
+using paa::Error;
+
+namespace {
+
+const uint64_t block_elements = 1 << 20;
+
+// File layout: header, then n_blocks + 1 block offsets from the start
+// of the data, then the compressed blocks
+struct compressed_header {
+  uint64_t count;  // number of elements
+  uint64_t element_size;
+  uint64_t width;  // bits per packed value, 0 for deflated bytes
+  uint64_t n_blocks;
+};
+
+// Blocks are encoded in batches on all cores and written as each batch
+// is done, so that only a batch is held in memory.  The offsets table
+// is filled in at the end.
+template <class Encode>
+void write_blocks(const string & file_name, const compressed_header & header,
+                  Encode encode) {
+  FILE * output = fopen(file_name.c_str(), "wb");
+  if (output == nullptr)
+    throw Error("could not open") << file_name << "for writing";
+  vector<uint64_t> offsets(header.n_blocks + 1, 0);
+  bwrite(output, header, "compressed header");
+  bwrite(output, offsets[0], "block offsets", offsets.size());
+  const unsigned int n_threads = n_cores();
+  vector<vector<unsigned char> > batch(4 * n_threads);
+  for (uint64_t first = 0; first < header.n_blocks; first += batch.size()) {
+    const uint64_t n_batch =
+        std::min<uint64_t>(batch.size(), header.n_blocks - first);
+    run_tasks(n_batch, n_threads, [&](const uint64_t b) {
+        encode(first + b, batch[b]);
+      });
+    for (uint64_t b = 0; b != n_batch; ++b) {
+      bwritec(output, batch[b].data(), "compressed blocks", batch[b].size());
+      offsets[first + b + 1] = offsets[first + b] + batch[b].size();
+    }
+  }
+  if (fseek(output, sizeof(header), SEEK_SET))
+    throw Error("problem seeking in") << file_name;
+  bwrite(output, offsets[0], "block offsets", offsets.size());
+  if (fclose(output) != 0) throw Error("problem closing") << file_name;
+}
+
+void pread_all(const int input, unsigned char * data, const uint64_t bytes,
+               const uint64_t offset, const string & file_name) {
+  uint64_t done = 0;
+  while (done != bytes) {
+    const ssize_t got = pread(input, data + done, bytes - done, offset + done);
+    if (got <= 0) throw Error("problem reading") << file_name;
+    done += got;
+  }
+}
+
+// Each thread reads and decodes whole blocks, taking the next unclaimed
+// block until none are left
+template <class Decode>
+void read_blocks(const string & file_name, const uint64_t count,
+                 const uint64_t element_size, const uint64_t width,
+                 void * data, const unsigned int n_threads,
+                 Decode decode) {
+  const int input = open(file_name.c_str(), O_RDONLY);
+  if (input == -1)
+    throw Error("could not open input") << file_name << "for reading";
+  compressed_header header;
+  pread_all(input, reinterpret_cast<unsigned char *>(&header),
+            sizeof(header), 0, file_name);
+  if (header.count != count || header.element_size != element_size ||
+      (width == 0) != (header.width == 0))
+    throw Error("compressed index file does not match index") << file_name;
+  vector<uint64_t> offsets(header.n_blocks + 1);
+  pread_all(input, reinterpret_cast<unsigned char *>(&offsets[0]),
+            offsets.size() * sizeof(uint64_t), sizeof(header), file_name);
+  const uint64_t data_start =
+      sizeof(header) + offsets.size() * sizeof(uint64_t);
+
+  try {
+    run_tasks(header.n_blocks, n_threads, [&](const uint64_t b) {
+        vector<unsigned char> buffer(offsets[b + 1] - offsets[b]);
+        pread_all(input, buffer.data(), buffer.size(),
+                  data_start + offsets[b], file_name);
+        const uint64_t first = b * block_elements;
+        const uint64_t n = std::min(block_elements, count - first);
+        decode(header, buffer, reinterpret_cast<unsigned char *>(data) +
+               first * element_size, n);
+      });
+  } catch (...) {
+    close(input);
+    throw;
+  }
+  if (close(input) == -1) throw Error("problem closing") << file_name;
+}
+
+}  // namespace
+
+void * index_memory(const uint64_t bytes) {
+  void * memory;
+  if (memory_mapped) {
+    if ((memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+      throw Error("anonymous memory map failure for") << bytes << "bytes";
+#ifdef MADV_HUGEPAGE
+    madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+  } else {
+    if ((memory = malloc(bytes)) == nullptr)
+      throw Error("malloc error for") << bytes << "bytes";
+  }
+  return memory;
+}
+
+void write_packed(const string & file_name, const ANINT * data,
+                  const uint64_t count) {
+  ANINT largest = 0;
+  for (uint64_t i = 0; i != count; ++i)
+    if (data[i] > largest) largest = data[i];
+  uint64_t width = 1;
+  while (width < 64 && (largest >> width)) ++width;
+  const compressed_header header{count, sizeof(ANINT), width,
+        (count + block_elements - 1) / block_elements};
+  write_blocks(file_name, header, [&](const uint64_t b,
+                                      vector<unsigned char> & packed) {
+      const uint64_t first = b * block_elements;
+      const uint64_t n = std::min(block_elements, count - first);
+      vector<uint64_t> words((n * width + 63) / 64, 0);
+      for (uint64_t i = 0; i != n; ++i) {
+        const uint64_t value = data[first + i];
+        const uint64_t bit = i * width;
+        const uint64_t shift = bit % 64;
+        words[bit / 64] |= value << shift;
+        if (shift + width > 64) words[bit / 64 + 1] |= value >> (64 - shift);
+      }
+      const unsigned char * bytes =
+          reinterpret_cast<const unsigned char *>(words.data());
+      packed.assign(bytes, bytes + words.size() * sizeof(uint64_t));
+    });
+}
+
+void read_packed(const string & file_name, ANINT * & data,
+                 const uint64_t count, const unsigned int n_threads) {
+  data = reinterpret_cast<ANINT *>(index_memory(count * sizeof(ANINT)));
+  read_blocks(file_name, count, sizeof(ANINT), 1, data, n_threads,
+              [](const compressed_header & header,
+                 const vector<unsigned char> & buffer,
+                 unsigned char * output, const uint64_t n) {
+                const uint64_t width = header.width;
+                const uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+                if (buffer.size() < (n * width + 63) / 64 * sizeof(uint64_t))
+                  throw Error("short packed block");
+                const uint64_t * words =
+                    reinterpret_cast<const uint64_t *>(buffer.data());
+                ANINT * values = reinterpret_cast<ANINT *>(output);
+                for (uint64_t i = 0; i != n; ++i) {
+                  const uint64_t bit = i * width;
+                  const uint64_t shift = bit % 64;
+                  uint64_t value = words[bit / 64] >> shift;
+                  if (shift + width > 64)
+                    value |= words[bit / 64 + 1] << (64 - shift);
+                  values[i] = value & mask;
+                }
+              });
+}
+
+void write_deflated(const string & file_name, const unsigned char * data,
+                    const uint64_t count) {
+  const compressed_header header{count, 1, 0,
+        (count + block_elements - 1) / block_elements};
+  write_blocks(file_name, header, [&](const uint64_t b,
+                                      vector<unsigned char> & deflated) {
+      const uint64_t first = b * block_elements;
+      const uint64_t n = std::min(block_elements, count - first);
+      deflated.resize(compressBound(block_elements));
+      uLongf size = deflated.size();
+      if (compress2(deflated.data(), &size, data + first, n,
+                    Z_DEFAULT_COMPRESSION) != Z_OK)
+        throw Error("deflate error for") << file_name;
+      deflated.resize(size);
+    });
+}
+
+void read_deflated(const string & file_name, unsigned char * & data,
+                   const uint64_t count, const unsigned int n_threads) {
+  data = reinterpret_cast<unsigned char *>(index_memory(count));
+  read_blocks(file_name, count, 1, 0, data, n_threads,
+              [](const compressed_header &,
+                 const vector<unsigned char> & buffer,
+                 unsigned char * output, const uint64_t n) {
+                uLongf size = n;
+                if (uncompress(output, &size, buffer.data(), buffer.size())
+                    != Z_OK || size != n)
+                  throw Error("inflate error");
+              });
+}
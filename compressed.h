@@ -0,0 +1,32 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#ifndef LONGMEM_COMPRESSED_H_
+#define LONGMEM_COMPRESSED_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "./size.h"
+
+// Index arrays stored in independently compressed blocks, so that many
+// threads can read and decompress them at once.  Integer arrays are bit
+// packed to the width of their largest value, and byte arrays are
+// deflated with zlib.  Arrays are decompressed into memory from
+// index_memory, so they are released like other loaded index arrays.
+
+// Anonymous memory (with huge pages advised) if memory mapping is on,
+// else malloc memory, so that munmap or free can release it.
+void * index_memory(const uint64_t bytes);
+
+void write_packed(const std::string & file_name, const ANINT * data,
+                  const uint64_t count);
+void read_packed(const std::string & file_name, ANINT * & data,
+                 const uint64_t count, const unsigned int n_threads);
+
+void write_deflated(const std::string & file_name,
+                    const unsigned char * data, const uint64_t count);
+void read_deflated(const std::string & file_name, unsigned char * & data,
+                   const uint64_t count, const unsigned int n_threads);
+
+#endif  // LONGMEM_COMPRESSED_H_
@@ -4,11 +4,12 @@
 
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <fstream>
 #include <sstream>
 #include <string>
-#include <algorithm>
+#include <vector>
 
 #include "./util.h"
 #include "./error.h"
@@ -18,46 +19,48 @@ using std::string;
 using std::cout;
 using std::cerr;
 using std::endl;
-using std::ifstream;
 using std::ostringstream;
+using std::vector;
+
+// Complement of a nucleotide or IUPAC ambiguity code.
+// Adapted from Kurtz code in MUMmer v3.
+char complement(const char ch) {
+  switch (ch) {
+    case 'a': return 't';
+    case 'c': return 'g';
+    case 'g': return 'c';
+    case 't': return 'a';
+    case 'r': return 'y'; /* a or g */
+    case 'y': return 'r'; /* c or t */
+    case 'm': return 'k'; /* a or c */
+    case 'k': return 'm'; /* g or t */
+    case 'b': return 'v'; /* c, g or t */
+    case 'd': return 'h'; /* a, g or t */
+    case 'h': return 'd'; /* a, c or t */
+    case 'v': return 'b'; /* a, c or g */
+    case 'A': return 'T';
+    case 'C': return 'G';
+    case 'G': return 'C';
+    case 'T': return 'A';
+    case 'R': return 'Y'; /* a or g */
+    case 'Y': return 'R'; /* c or t */
+    case 'M': return 'K'; /* a or c */
+    case 'K': return 'M'; /* g or t */
+    case 'B': return 'V'; /* c, g or t */
+    case 'D': return 'H'; /* a, g or t */
+    case 'H': return 'D'; /* a, c or t */
+    case 'V': return 'B'; /* a, c or g */
+    default: return ch;
+  }
+}
 
 // Return the reverse complement of sequence. This allows searching
 // the plus strand of instances on the minus strand.
 void reverse_complement(string * const seq_rc) {
   // Reverse in-place.
   reverse(seq_rc->begin(), seq_rc->end());
-  for (uint64_t i = 0; i != seq_rc->size(); ++i) {
-    // Adapted from Kurtz code in MUMmer v3.
-    char & ch = (*seq_rc)[i];
-    switch (ch) {
-    case 'a': ch = 't'; break;
-    case 'c': ch = 'g'; break;
-    case 'g': ch = 'c'; break;
-    case 't': ch = 'a'; break;
-    case 'r': ch = 'y'; break; /* a or g */
-    case 'y': ch = 'r'; break; /* c or t */
-    case 'm': ch = 'k'; break; /* a or c */
-    case 'k': ch = 'm'; break; /* g or t */
-    case 'b': ch = 'v'; break; /* c, g or t */
-    case 'd': ch = 'h'; break; /* a, g or t */
-    case 'h': ch = 'd'; break; /* a, c or t */
-    case 'v': ch = 'b'; break; /* a, c or g */
-    case 'A': ch = 'T'; break;
-    case 'C': ch = 'G'; break;
-    case 'G': ch = 'C'; break;
-    case 'T': ch = 'A'; break;
-    case 'R': ch = 'Y'; break; /* a or g */
-    case 'Y': ch = 'R'; break; /* c or t */
-    case 'M': ch = 'K'; break; /* a or c */
-    case 'K': ch = 'M'; break; /* g or t */
-    case 'B': ch = 'V'; break; /* c, g or t */
-    case 'D': ch = 'H'; break; /* a, g or t */
-    case 'H': ch = 'D'; break; /* a, c or t */
-    case 'V': ch = 'B'; break; /* a, c or g */
-      default:
-        break;
-    }
-  }
+  for (uint64_t i = 0; i != seq_rc->size(); ++i)
+    (*seq_rc)[i] = complement((*seq_rc)[i]);
 }
 
 // Trim a string, giving start and end in trimmed version.
@@ -78,6 +81,62 @@ void trim(const string &line, uint64_t &start, uint64_t &end) {
     }
   }
 }
+// Part of the sequence lines of a fasta record, made of whole lines
+struct fasta_piece {
+  fasta_piece(const char * b, const char * e, const uint64_t r)
+      : begin(b), end(e), record(r), offset(0), length(0) {}
+  const char * begin;
+  const char * end;
+  uint64_t record;
+  uint64_t offset;  // of the first base in the record
+  uint64_t length;  // number of bases
+};
+
+// Lowercase of each character, filled before any thread reads it
+static const class LowerTable {
+ public:
+  LowerTable() {
+    for (unsigned int c = 0; c != 256; ++c) lower[c] = tolower(c);
+  }
+  unsigned char lower[256];
+} lower_table;
+
+// Bases in the lines of [begin, end), trimmed of spaces as by trim and
+// lowercased, copied to out unless it is null.
+static uint64_t fasta_bases(const char * begin, const char * const end,
+                            char * out) {
+  const unsigned char * const lower = lower_table.lower;
+  uint64_t n_bases = 0;
+  while (begin < end) {
+    const char * eol = reinterpret_cast<const char *>(
+        memchr(begin, '\n', end - begin));
+    if (eol == nullptr) eol = end;
+    const uint64_t length = eol - begin;
+    if (length) {
+      uint64_t start = 0, stop = length;
+      for (uint64_t i = 0; i != length; ++i) {
+        if (begin[i] != ' ') {
+          start = i;
+          break;
+        }
+      }
+      for (uint64_t i = length; i != 1; --i) {
+        if (begin[i - 1] != ' ') {
+          stop = i;
+          break;
+        }
+      }
+      if (out) {
+        for (uint64_t i = start; i != stop; ++i)
+          *out++ = lower[static_cast<unsigned char>(begin[i])];
+      }
+      n_bases += stop - start;
+    }
+    begin = eol + 1;
+  }
+  return n_bases;
+}
+
 Sequence::~Sequence() {
   if (memory_mapped && using_mapping) {
     if (munmap(seq, N * sizeof(*seq)))
@@ -138,69 +197,109 @@ Sequence::Sequence(const RefArgs & arguments)
   } else {
     if (verbose) cerr << "# loading reference from fasta" << endl;
 
-    string meta, line;
-    uint64_t length = 0;
-
-    // Everything starts at zero.
-    startpos.push_back(0);
-
-    ifstream data(ref_fasta);
-
-    if (!data.is_open()) throw Error("unable to open") << ref_fasta;
-
-    while (!data.eof()) {
-      getline(data, line);  // Load one line at a time.
-      if (!data.eof() && line.size() == 0) continue;
-
-      uint64_t start = 0, end = line.size();
-
-      // Meta tag line and start of a new sequence.
-      if (data.eof() || line[0] == '>') {
-        // Save previous sequence and meta data.
-        if (length > 0) {
-          const uint64_t this_start = startpos.back();
-          if (verbose) cerr << "# " << meta << " " << length
-                            << " " << this_start << endl;
-          descr.push_back(meta);
-          if (rcref || !data.eof()) {
-            seq_vec.push_back('`');  // ` character used to separate strings
-            startpos.push_back(seq_vec.size());
-          }
-          sizes.push_back(length);
-          if (rcref) {
-            descr.push_back(meta);
-            sizes.push_back(length);
-            string reversed(seq_vec.begin() + this_start,
-                            seq_vec.begin() + this_start + length);
-            reverse_complement(&reversed);
-            seq_vec.insert(seq_vec.end(), reversed.begin(), reversed.end());
-            if (!data.eof()) {
-              seq_vec.push_back('`');  // ` character used to separate strings
-              startpos.push_back(seq_vec.size());
-            }
-          }
-          if (data.eof()) break;
+    // Find records, and split their sequence lines into pieces to share
+    // among threads.  Lines before the first header form a nameless record.
+    MappedFile fasta(ref_fasta);
+    const char * const fasta_end = fasta.end();
+    vector<string> metas;
+    vector<fasta_piece> pieces;
+    const uint64_t piece_size = 16 << 20;
+    const char * body = fasta.begin();
+    while (body < fasta_end) {
+      const char * header = body;
+      while ((header = reinterpret_cast<const char *>(
+              memchr(header, '>', fasta_end - header))) != nullptr &&
+             header != fasta.begin() && header[-1] != '\n') ++header;
+      const char * const body_end = header ? header : fasta_end;
+      while (body < body_end) {
+        const char * piece_end = body + piece_size;
+        if (piece_end >= body_end) {
+          piece_end = body_end;
+        } else {
+          piece_end = reinterpret_cast<const char *>(
+              memchr(piece_end, '\n', body_end - piece_end));
+          piece_end = piece_end ? piece_end + 1 : body_end;
         }
-        // Reset parser state.
-        start = 1;
-        meta = "";
-        length = 0;
+        pieces.emplace_back(body, piece_end, metas.size() - 1);
+        body = piece_end;
       }
-      trim(line, start, end);
-      // Collect meta data.
-      if (line[0] == '>') {
-        for (uint64_t i = start; i != end; ++i) {
-          if (line[i] == ' ') break;
-          meta += line[i];
-        }
-      } else {  // Collect sequence data.
-        length += end - start;
-        for (uint64_t i = start; i != end; ++i) {
-          seq_vec.push_back(tolower(line[i]));
-        }
+      if (header == nullptr) break;
+      // Name is the header up to the first space after leading spaces
+      const char * eol = reinterpret_cast<const char *>(
+          memchr(header, '\n', fasta_end - header));
+      if (eol == nullptr) eol = fasta_end;
+      const char * name = header + 1;
+      while (name != eol && *name == ' ') ++name;
+      if (name == eol) name = header + 1;
+      metas.push_back(string(name, std::find(name, eol, ' ')));
+      body = eol + 1;
+    }
+    // A nameless record is present only if lines precede the first header
+    if (!pieces.empty() && pieces.front().record == uint64_t(-1)) {
+      metas.insert(metas.begin(), string());
+      for (fasta_piece & piece : pieces) ++piece.record;
+    }
+
+    // Count bases in pieces, then lay out records with a ` character
+    // separating strings, each followed by its reverse complement if rcref
+    run_tasks(pieces.size(), n_cores(), [&pieces](const uint64_t p) {
+        pieces[p].length = fasta_bases(pieces[p].begin, pieces[p].end,
+                                       nullptr);
+      });
+    vector<uint64_t> lengths(metas.size());
+    for (fasta_piece & piece : pieces) {
+      piece.offset = lengths[piece.record];
+      lengths[piece.record] += piece.length;
+    }
+    // Only the final record of the file, if it has bases, goes without
+    // separators: after a trailing empty record the last bases are still
+    // followed by one, as the line by line parser did
+    uint64_t last_record = metas.size();
+    if (!lengths.empty() && lengths.back()) last_record = metas.size() - 1;
+    vector<uint64_t> fwd_starts(metas.size()), rc_starts(metas.size());
+    uint64_t position = 0;
+    for (uint64_t r = 0; r != metas.size(); ++r) {
+      if (lengths[r] == 0) continue;
+      const bool last = r == last_record;
+      fwd_starts[r] = position;
+      startpos.push_back(position);
+      descr.push_back(metas[r]);
+      sizes.push_back(lengths[r]);
+      if (verbose) cerr << "# " << metas[r] << " " << lengths[r]
+                        << " " << position << endl;
+      position += lengths[r] + (rcref || !last);
+      if (rcref) {
+        rc_starts[r] = position;
+        startpos.push_back(position);
+        descr.push_back(metas[r]);
+        sizes.push_back(lengths[r]);
+        position += lengths[r] + !last;
       }
     }
-    seq_vec.push_back('$');
+    if (startpos.empty()) startpos.push_back(0);
+    seq_vec.resize(position + 1);
+    for (uint64_t r = 0; r != metas.size(); ++r) {
+      if (lengths[r] == 0) continue;
+      const bool last = r == last_record;
+      if (rcref || !last) seq_vec[fwd_starts[r] + lengths[r]] = '`';
+      if (rcref && !last) seq_vec[rc_starts[r] + lengths[r]] = '`';
+    }
+    seq_vec.back() = '$';
+
+    // Fill in bases and reverse complements
+    char * const out = &seq_vec[0];
+    run_tasks(pieces.size(), n_cores(), [&](const uint64_t p) {
+        const fasta_piece & piece = pieces[p];
+        char * const fwd = out + fwd_starts[piece.record] + piece.offset;
+        fasta_bases(piece.begin, piece.end, fwd);
+        if (rcref) {
+          char * rc = out + rc_starts[piece.record] +
+              lengths[piece.record] - piece.offset;
+          for (uint64_t b = 0; b != piece.length; ++b)
+            *--rc = complement(fwd[b]);
+        }
+      });
+    fasta.unmap();
     if (verbose) cerr << "# seq_vec.length=" << seq_vec.size() << endl;
 
     N = seq_vec.size();
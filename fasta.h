@@ -8,6 +8,7 @@
 
 #include "./size.h"
 
+char complement(const char ch);
 void reverse_complement(std::string * const seq_rc);
 void trim(const std::string & line, uint64_t & start, uint64_t & end);
 
@@ -4,92 +4,153 @@
 // Copyright 2014 Peter Andrews @ CSHL
 //
 
+#include <ctype.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <exception>
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
-#include <vector>
 
 #include "./error.h"
-#include "./strings.h"
+#include "./util.h"
 
-using std::cout;
 using std::cerr;
 using std::endl;
 using std::exception;
-using std::ifstream;
-using std::istringstream;
 using std::string;
-using std::vector;
 
 using paa::Error;
-using paa::replace;
 
-int main(int argc, char ** argv) try {
-  if (argc != 3 && argc != 4)
-    throw Error("usage: fastqs_to_sam fq1 fq2 [replaceN]");
-  const string fastq1_name = argv[1];
-  const string fastq2_name = argv[2];
-  ifstream fastq1(fastq1_name.c_str());
-  if (!fastq1) throw Error("Could not open fastq file") << fastq1_name;
-  ifstream fastq2(fastq2_name.c_str());
-  if (!fastq2) throw Error("Could not open fastq file") << fastq2_name;
-  const char tab = '\t';
-  vector<ifstream *> input{&fastq1, &fastq2};
-
-  char ampersand;
+namespace {
+
+// One record of a fastq (or fasta) file
+struct Record {
+  char start;  // @ or >
   string read_name;
-  string line;
+  string optional;
   string bases;
-  char plus = '+';
   string errors;
-  while (fastq1 && fastq2) {
-    if (!cout) break;
-    for (unsigned int i = 0; i != input.size(); ++i) {
-      ifstream & in = *input[i];
-      in >> ampersand;
-      if (!in) break;
-      getline(in, line);
-      istringstream line_stream{line.c_str()};
-      line_stream >> read_name;
-      if (!line_stream)
-        throw Error("Problem reading read name");
-      string optional{""};
-      line_stream >> optional;
-      // getline(in, optional);
-      getline(in, bases);
-      if (ampersand == '@') {
-        in >> plus;
-        getline(in, errors);
-        getline(in, errors);
+};
+
+// First non-space character, skipping blank lines
+bool next_start(LineReader & in, const char * & line, uint64_t & length) {
+  while (in.next(line, length)) {
+    while (length && isspace(*line)) {
+      ++line;
+      --length;
+    }
+    if (length) return true;
+  }
+  return false;
+}
+
+// Next whitespace delimited word
+void next_word(const char * & begin, const char * end, string & word) {
+  while (begin != end && isspace(*begin)) ++begin;
+  const char * const start = begin;
+  while (begin != end && !isspace(*begin)) ++begin;
+  word.assign(start, begin);
+}
+
+bool read_record(LineReader & in, Record & record, char & plus) {
+  const char * line;
+  uint64_t length;
+  if (!next_start(in, line, length)) return false;
+  record.start = *line;
+  const char * begin = line + 1;
+  const char * const end = line + length;
+  next_word(begin, end, record.read_name);
+  if (record.read_name.empty())
+    throw Error("Problem reading read name");
+  next_word(begin, end, record.optional);
+  if (in.next(line, length)) {
+    record.bases.assign(line, length);
+  } else {
+    record.bases.clear();
+  }
+  if (record.start == '@') {
+    if (next_start(in, line, length)) plus = *line;
+    if (in.next(line, length)) {
+      record.errors.assign(line, length);
+    } else {
+      record.errors.clear();
+    }
+  } else {
+    record.errors = record.bases;
+  }
+  return true;
+}
+
+// Output is assembled in a large buffer and written in blocks
+class Output {
+ public:
+  Output() : good(true) { buffer.reserve(capacity + (1 << 20)); }
+  ~Output() { flush(); }
+  void add(const string & text) { buffer += text; }
+  void add(const char * text) { buffer += text; }
+  void add(const char c) { buffer += c; }
+  bool ok() {
+    if (buffer.size() >= capacity) flush();
+    return good;
+  }
+
+ private:
+  void flush() {
+    const char * data = buffer.data();
+    uint64_t left = buffer.size();
+    while (good && left) {
+      const ssize_t n = write(1, data, left);
+      if (n <= 0) {
+        good = false;
       } else {
-        errors = bases;
+        data += n;
+        left -= n;
       }
-      if (argc == 4) replace(bases, 'N', 'Z');
+    }
+    buffer.clear();
+  }
+  static const uint64_t capacity = 4 << 20;
+  string buffer;
+  bool good;
+};
+
+}  // namespace
+
+int main(int argc, char ** argv) try {
+  if (argc != 3 && argc != 4)
+    throw Error("usage: fastqs_to_sam fq1 fq2 [replaceN]");
+  const bool replace_n = argc == 4;
+  LineReader fastq1(argv[1]);
+  LineReader fastq2(argv[2]);
+  LineReader * const input[2]{&fastq1, &fastq2};
+
+  Output out;
+  Record record;
+  char plus = '+';
+  while (out.ok()) {
+    for (unsigned int i = 0; i != 2; ++i) {
+      if (!read_record(*input[i], record, plus)) return 0;
+      if (replace_n)
+        std::replace(record.bases.begin(), record.bases.end(), 'N', 'Z');
       if (plus != '+') {
         throw Error("Fastq + parse error");
       }
-      if (ampersand != '@' && ampersand != '>') {
+      if (record.start != '@' && record.start != '>') {
         throw Error("Fastq @ parse error");
       }
-      if (bases.size()) {
-        cout << read_name << tab
-             << (i ? 141 : 77) << tab
-             << '*' << tab
-             << 0 << tab
-             << 0 << tab
-             << '*' << tab
-             << '*' << tab
-             << 0 << tab
-             << 0 << tab
-             << bases << tab
-             << errors;
-        if (optional.size()) {
-          cout << tab
-               << "XO:Z:" << optional;
+      if (record.bases.size()) {
+        out.add(record.read_name);
+        out.add(i ? "\t141\t*\t0\t0\t*\t*\t0\t0\t" :
+                "\t77\t*\t0\t0\t*\t*\t0\t0\t");
+        out.add(record.bases);
+        out.add('\t');
+        out.add(record.errors);
+        if (record.optional.size()) {
+          out.add("\tXO:Z:");
+          out.add(record.optional);
         }
-        cout << endl;
+        out.add('\n');
       }
     }
   }
@@ -0,0 +1,91 @@
+//
+// interleave_index
+//
+// Converts the suffix array and LCP files of an existing mummer index
+// into the interleaved block layout used by mummer -interleaved
+//
+// Copyright 2013 Peter Andrews @ CSHL
+//
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "./error.h"
+#include "./longSA.h"
+#include "./util.h"
+
+using std::cerr;
+using std::endl;
+using std::exception;
+using std::ostringstream;
+using std::string;
+
+using paa::Error;
+
+int main(int argc, char ** argv) try {
+  --argc;
+  const bool rcref = argc == 2 && string(argv[1]) == "-rcref";
+  if (argc != 1 && !rcref)
+    throw Error("usage: interleave_index [-rcref] ref_fasta");
+  const string ref_fasta = argv[argc];
+
+  ostringstream bin_base_stream;
+  bin_base_stream << ref_fasta << ".bin/rc" << rcref
+                  << ".i" << sizeof(ANINT) << ".index";
+  const string bin_base = bin_base_stream.str();
+  const string saved_index = bin_base + ".bin";
+  const string saved_salcp = bin_base + ".salcp.bin";
+
+  FILE * index = fopen(saved_index.c_str(), "rb");
+  if (index == nullptr)
+    throw Error("could not open index") << saved_index << "for reading"
+                                        << "- run mummer to create it first";
+  uint64_t fasta_size;
+  bread(index, fasta_size, "fasta_size");
+  if (fasta_size != file_size(ref_fasta))
+    throw Error("saved fasta size used for index does not "
+                "match current fasta size");
+  uint64_t dummy;
+  bread(index, dummy, "logN");
+  bread(index, dummy, "Nm1");
+  uint64_t N;
+  bread(index, N, "SA_size");
+  if (file_size(bin_base + ".sa.bin") != N * sizeof(ANINT))
+    throw Error("suffix array file has the wrong size") << bin_base;
+
+  ANINT * SA = nullptr;
+  bread(bin_base + ".sa.bin", SA, "SA", N);
+  vec_uchar LCP;
+  LCP.load(bin_base, index);
+  if (fclose(index) != 0) throw Error("problem closing index file");
+
+  sa_lcp_blocks SALCP;
+  SALCP.build(SA, LCP, N);
+  FILE * salcp = fopen(saved_salcp.c_str(), "wb");
+  if (salcp == nullptr)
+    throw Error("could not open") << saved_salcp << "for writing";
+  bwrite(salcp, fasta_size, "fasta_size");
+  SALCP.save(bin_base, salcp);
+  if (fclose(salcp) != 0) throw Error("problem closing interleaved index");
+
+  if (memory_mapped) {
+    if (munmap(SA, N * sizeof(ANINT))) throw Error("SA memory unmap failure");
+  } else {
+    free(SA);
+  }
+  cerr << "wrote " << N << " interleaved suffix array and LCP values to "
+       << saved_salcp << endl;
+
+  return 0;
+} catch(exception & e) {
+  cerr << e.what() << endl;
+  return 1;
+} catch(...) {
+  cerr << "Some exception was caught." << endl;
+  return 1;
+}
@@ -3,10 +3,14 @@
 #ifndef LONGMEM_LOCKED_H_
 #define LONGMEM_LOCKED_H_
 
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <cstdio>
 #include <vector>
 
@@ -155,6 +159,198 @@ class RingBuffer {
   RingBuffer & operator=(const RingBuffer & disabled_assignment_operator);
 };
 
+// Ring with one producer at a time and any number of consumers.  Items
+// are copied in and out of their slot atomically, so T must be
+// trivially copyable.  A consumer that read a slot the producer then
+// reused loses its claim on begin and tries again.  begin and end are
+// kept on their own cache lines.
+template<class T>
+class LockFreeRing {
+ public:
+  explicit LockFreeRing(const uint64_t N_ = 1000, const T & t = T()) :
+      N(N_), buffer(N, t) {
+    init();
+  }
+  // Copies are made before use, as for vector elements
+  LockFreeRing(const LockFreeRing & other) : N(other.N), buffer(other.buffer) {
+    init();
+  }
+
+  // Producer: false if full
+  bool push(const T & item) {
+    if (end_ - begin_cache + 1 >= N) {
+      begin_cache = begin.load(std::memory_order_acquire);
+      if (end_ - begin_cache + 1 >= N) return false;
+    }
+    __atomic_store(&buffer[end_ % N], const_cast<T *>(&item),
+                   __ATOMIC_RELAXED);
+    end.store(++end_, std::memory_order_release);
+    return true;
+  }
+  // Consumers: oldest item, or false if empty
+  bool take(T & item) {
+    uint64_t first = begin.load(std::memory_order_acquire);
+    while (first != end.load(std::memory_order_acquire)) {
+      __atomic_load(&buffer[first % N], &item, __ATOMIC_RELAXED);
+      if (begin.compare_exchange_weak(first, first + 1,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_acquire))
+        return true;
+    }
+    return false;
+  }
+  // Items queued, safe to read from any thread
+  uint64_t size() const {
+    const uint64_t first = begin.load(std::memory_order_acquire);
+    return end.load(std::memory_order_acquire) - first;
+  }
+
+ private:
+  void init() {
+    begin = end = 0;
+    end_ = begin_cache = 0;
+  }
+  static const uint64_t line = 64;
+  const uint64_t N;
+  std::vector<T> buffer;
+  char pad0[line];
+  std::atomic<uint64_t> begin;  // claimed by consumers
+  char pad1[line];
+  std::atomic<uint64_t> end;  // written by the producer
+  uint64_t end_;  // producer copy of end
+  uint64_t begin_cache;  // producer copy of begin
+  char pad2[line];
+  LockFreeRing & operator=(const LockFreeRing & disabled_assignment_operator);
+};
+
+// Per-worker rings of work items.  Producers, which are serialized,
+// deal items to the rings in turn.  A worker takes the oldest item of
+// its own ring and, when that is empty, steals the oldest item of the
+// fullest other ring, so that slow items do not hold up work queued
+// behind them.  Taking and stealing are lock free.  A worker that finds
+// every ring empty spins, then sleeps on a futex that push wakes.  Its
+// spin limit adapts: it grows when spinning was enough and shrinks when
+// the worker had to sleep anyway.  At most max_items may be queued at
+// once, as callers bound their items with a pool.
+template<class T>
+class WorkStealingQueue {
+ public:
+  WorkStealingQueue(const unsigned int n_workers, const uint64_t max_items) :
+      rings(n_workers, LockFreeRing<T>(max_items + 1)),
+      spins(n_workers, 1024), next_worker(0), closed(false),
+      n_waiting(0), wakeups(0), n_sleeps(0), n_stolen(0) {
+    pthread_mutex_init(&push_mutex, nullptr);
+  }
+  ~WorkStealingQueue() {
+    pthread_mutex_destroy(&push_mutex);
+  }
+
+  void push(const T & item) {
+    lock(&push_mutex);
+    const bool pushed = rings[next_worker++ % rings.size()].push(item);
+    unlock(&push_mutex);
+    if (!pushed) throw paa::Error("work stealing queue overflow");
+    wake(1);
+  }
+
+  // Returns false once closed and empty
+  bool pop(const unsigned int worker, T & item) {
+    while (true) {
+      if (rings[worker].take(item)) return true;
+      if (steal(worker, item)) return true;
+      // Closed is set after the last push, so empty rings stay empty
+      if (closed.load(std::memory_order_acquire) && empty()) return false;
+      wait(worker);
+    }
+  }
+
+  // No more items will be pushed
+  void close() {
+    closed.store(true, std::memory_order_release);
+    wake(INT32_MAX);
+  }
+
+  // Counts, to read once producers and workers are done
+  uint64_t idle_waits() const { return n_sleeps; }  // pop slept on futex
+  uint64_t steals() const { return n_stolen; }
+
+ private:
+  static const uint64_t min_spin = 64;
+  static const uint64_t max_spin = 1 << 16;
+  bool empty() const {
+    for (const LockFreeRing<T> & ring : rings) if (ring.size()) return false;
+    return true;
+  }
+  bool ready() const {
+    return closed.load(std::memory_order_acquire) || !empty();
+  }
+  bool steal(const unsigned int worker, T & item) {
+    while (true) {
+      unsigned int victim = worker;
+      uint64_t most = 0;
+      for (unsigned int w = 0; w != rings.size(); ++w) {
+        const uint64_t size = rings[w].size();
+        if (w != worker && size > most) {
+          most = size;
+          victim = w;
+        }
+      }
+      if (victim == worker) return false;
+      if (rings[victim].take(item)) {
+        n_stolen.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+  }
+  // The fences pair up: either a waiter sees the new item or closed, or
+  // wake sees the waiter and changes the futex word before it sleeps
+  void wait(const unsigned int worker) {
+    uint64_t & spin = spins[worker];
+    for (uint64_t s = 0; s != spin; ++s) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+      if (ready()) {
+        if (spin < max_spin) spin *= 2;
+        return;
+      }
+    }
+    if (spin > min_spin) spin /= 2;
+    n_sleeps.fetch_add(1, std::memory_order_relaxed);
+    n_waiting.fetch_add(1, std::memory_order_seq_cst);
+    while (true) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const uint32_t seen = wakeups.load(std::memory_order_acquire);
+      if (ready()) break;
+      futex(FUTEX_WAIT_PRIVATE, seen);
+    }
+    n_waiting.fetch_sub(1, std::memory_order_relaxed);
+  }
+  void wake(const int n_wake) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (n_waiting.load(std::memory_order_relaxed)) {
+      wakeups.fetch_add(1, std::memory_order_release);
+      futex(FUTEX_WAKE_PRIVATE, n_wake);
+    }
+  }
+  void futex(const int op, const uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&wakeups), op, value,
+            nullptr, nullptr, 0);
+  }
+  std::vector<LockFreeRing<T> > rings;
+  std::vector<uint64_t> spins;  // per worker spin limit
+  uint64_t next_worker;  // under push_mutex
+  std::atomic<bool> closed;
+  std::atomic<unsigned int> n_waiting;  // workers that may sleep
+  std::atomic<uint32_t> wakeups;  // futex word
+  std::atomic<uint64_t> n_sleeps;
+  std::atomic<uint64_t> n_stolen;
+  pthread_mutex_t push_mutex;
+  WorkStealingQueue(const WorkStealingQueue & disabled_copy_constructor);
+  WorkStealingQueue & operator=(
+      const WorkStealingQueue & disabled_assignment_operator);
+};
+
 class OutputBuffer {
  public:
   OutputBuffer(const uint64_t max_size_ = 100000,
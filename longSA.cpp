@@ -4,10 +4,12 @@
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include <algorithm>
 using std::max;
+using std::min;
 using std::sort;
 
 #include <string>
@@ -26,11 +28,16 @@ using std::ostringstream;
 using std::ostream;
 using std::ofstream;
 
+#include <chrono>
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
 #include <iostream>
 using std::cout;
 using std::cerr;
 using std::endl;
 
+#include "./compressed.h"
 #include "./query.h"
 #include "./util.h"
 #include "./error.h"
@@ -59,20 +66,35 @@ void vec_uchar::init() {
   sort(M, M + N_M);
 }
 
-void vec_uchar::load(const string & base, FILE * index) {
+void vec_uchar::load(const string & base, FILE * index,
+                     const string & name) {
   using_mapping = true;
   bread(index, N_vec, "N_vec");
-  bread(base + ".lcp.vec.bin", vec, "vec", N_vec);
+  bread(base + "." + name + ".vec.bin", vec, "vec", N_vec);
   bread(index, N_M, "N_M");
-  bread(base + ".lcp.m.bin", M, "M", N_M);
+  bread(base + "." + name + ".m.bin", M, "M", N_M);
 }
 
-void vec_uchar::save(const string & base, FILE * index) const {
+void vec_uchar::save(const string & base, FILE * index,
+                     const string & name) const {
   bwrite(index, N_vec, "N_vec");
-  bwrite(base + ".lcp.vec.bin", vec[0], "vec", N_vec);
+  bwrite(base + "." + name + ".vec.bin", vec[0], "vec", N_vec);
   bwrite(index, N_M, "N_M");
-  bwrite(base + ".lcp.m.bin", M[0], "M", N_M);
+  bwrite(base + "." + name + ".m.bin", M[0], "M", N_M);
 }
+void vec_uchar::load_compressed(const string & base, FILE * index,
+                                const unsigned int n_threads) {
+  using_mapping = true;
+  bread(index, N_vec, "N_vec");
+  read_deflated(base + ".lcp.vec.z", vec, N_vec, n_threads);
+  bread(index, N_M, "N_M");
+  bread(base + ".lcp.m.bin", M, "M", N_M);
+}
+
+void vec_uchar::save_compressed(const string & base) const {
+  write_deflated(base + ".lcp.vec.z", vec, N_vec);
+}
+
 vec_uchar::~vec_uchar() {
   if (memory_mapped && using_mapping) {
     if (munmap(vec, N_vec * sizeof(unsigned char)))
@@ -91,10 +113,195 @@ void vec_uchar::resize(const size_t N) {
     throw Error("malloc error for lcp");
 }
 
+sa_lcp_blocks::~sa_lcp_blocks() {
+  if (memory_mapped && using_mapping) {
+    if (n_blocks) munmap(blocks, n_blocks * sizeof(block_t));
+    if (N_M) munmap(M, N_M * sizeof(item_t));
+  } else {
+    free(blocks);
+    free(M);
+  }
+}
+
+const uint64_t sa_lcp_blocks::block_entries;
+
+void sa_lcp_blocks::build(const ANINT * SA, const vec_uchar & LCP,
+                          const uint64_t N_) {
+  N = N_;
+  n_blocks = (N + block_entries - 1) / block_entries;
+  if (posix_memalign(reinterpret_cast<void **>(&blocks), sizeof(block_t),
+                     n_blocks * sizeof(block_t)))
+    throw Error("blocks malloc error");
+  memset(blocks, 0, n_blocks * sizeof(block_t));
+  N_M = 0;
+  for (uint64_t i = 0; i != N; ++i)
+    if (LCP[i] >= numeric_limits<unsigned char>::max()) ++N_M;
+  if (N_M && (M = reinterpret_cast<item_t *>(
+          malloc(sizeof(item_t) * N_M))) == nullptr)
+    throw Error("blocks M malloc error");
+  uint64_t m = 0;
+  for (uint64_t i = 0; i != N; ++i) {
+    block_t & block = blocks[i / block_entries];
+    const ANINT v = LCP[i];
+    block.sa[i % block_entries] = SA[i];
+    if (v >= numeric_limits<unsigned char>::max()) {
+      block.lcp[i % block_entries] = numeric_limits<unsigned char>::max();
+      M[m++] = item_t(i, v);
+    } else {
+      block.lcp[i % block_entries] = static_cast<unsigned char>(v);
+    }
+  }
+}
+
+void sa_lcp_blocks::load(const string & base, FILE * index) {
+  uint64_t saved_entries;
+  bread(index, saved_entries, "block_entries");
+  if (saved_entries != block_entries)
+    throw Error("interleaved index was made for another integer size");
+  bread(index, N, "N");
+  bread(index, n_blocks, "n_blocks");
+  bread(index, N_M, "N_M");
+  using_mapping = true;
+  bread(base + ".salcp.blocks.bin", blocks, "blocks", n_blocks);
+  bread(base + ".salcp.m.bin", M, "M", N_M);
+}
+
+void sa_lcp_blocks::save(const string & base, FILE * index) const {
+  bwrite(index, block_entries, "block_entries");
+  bwrite(index, N, "N");
+  bwrite(index, n_blocks, "n_blocks");
+  bwrite(index, N_M, "N_M");
+  bwrite(base + ".salcp.blocks.bin", blocks[0], "blocks", n_blocks);
+  bwrite(base + ".salcp.m.bin", M[0], "M", N_M);
+}
+
+const uint64_t top_tree::key_length;
+const uint64_t top_tree::default_step;
+
+top_tree::~top_tree() {
+  if (memory_mapped && using_mapping) {
+    if (n) munmap(nodes, (n + 1) * sizeof(node_t));
+    if (n) munmap(ranks, (n + 1) * sizeof(ANINT));
+  } else {
+    free(nodes);
+    free(ranks);
+  }
+}
+
+// In order traversal of the implicit tree visits nodes in sorted order
+uint64_t top_tree::fill(const vector<node_t> & sorted, uint64_t i,
+                        const uint64_t k) {
+  if (k <= n) {
+    i = fill(sorted, i, 2 * k);
+    nodes[k] = sorted[i];
+    ranks[k] = i++;
+    i = fill(sorted, i, 2 * k + 1);
+  }
+  return i;
+}
+
+void top_tree::build(const vector<node_t> & sorted, const uint64_t step_,
+                     const uint64_t N_) {
+  N = N_;
+  step = step_;
+  n = sorted.size();
+  if (posix_memalign(reinterpret_cast<void **>(&nodes), 64,
+                     (n + 1) * sizeof(node_t)))
+    throw Error("top tree malloc error");
+  if ((ranks = reinterpret_cast<ANINT *>(
+          malloc((n + 1) * sizeof(ANINT)))) == nullptr)
+    throw Error("top tree ranks malloc error");
+  memset(nodes, 0, sizeof(node_t));
+  ranks[0] = 0;
+  fill(sorted, 0, 1);
+}
+
+void top_tree::load(const string & base, FILE * index) {
+  bread(index, N, "N");
+  bread(index, step, "step");
+  bread(index, n, "n");
+  using_mapping = true;
+  bread(base + ".toptree.nodes.bin", nodes, "nodes", n + 1);
+  bread(base + ".toptree.ranks.bin", ranks, "ranks", n + 1);
+}
+
+void top_tree::save(const string & base, FILE * index) const {
+  bwrite(index, N, "N");
+  bwrite(index, step, "step");
+  bwrite(index, n, "n");
+  bwrite(base + ".toptree.nodes.bin", nodes[0], "nodes", n + 1);
+  bwrite(base + ".toptree.ranks.bin", ranks[0], "ranks", n + 1);
+}
+
+unique_kmers::~unique_kmers() {
+  if (memory_mapped && using_mapping) {
+    if (capacity) munmap(keys, capacity * sizeof(uint64_t));
+    if (capacity) munmap(positions, capacity * sizeof(ANINT));
+  } else {
+    free(keys);
+    free(positions);
+  }
+}
+
+void unique_kmers::resize(const unsigned int k_, const uint64_t n) {
+  k = k_;
+  n_kmers = 0;
+  capacity = 2;
+  shift = 63;
+  while (capacity < 2 * n) {
+    capacity *= 2;
+    --shift;
+  }
+  if ((keys = reinterpret_cast<uint64_t *>(
+          malloc(sizeof(uint64_t) * capacity))) == nullptr)
+    throw Error("unique keys malloc error");
+  if ((positions = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * capacity))) == nullptr)
+    throw Error("unique positions malloc error");
+  for (uint64_t i = 0; i != capacity; ++i) positions[i] = empty_slot;
+}
+
+void unique_kmers::insert(const uint64_t code, const ANINT pos) {
+  uint64_t slot = hash(code);
+  while (positions[slot] != empty_slot) slot = (slot + 1) & (capacity - 1);
+  keys[slot] = code;
+  positions[slot] = pos;
+  ++n_kmers;
+}
+
+void unique_kmers::load(const string & base) {
+  const string saved = base + ".bin";
+  FILE * index = fopen(saved.c_str(), "rb");
+  if (index == nullptr)
+    throw Error("could not open unique index") << saved << "for reading";
+  bread(index, k, "k");
+  bread(index, capacity, "capacity");
+  bread(index, n_kmers, "n_kmers");
+  if (fclose(index) != 0) throw Error("problem closing unique index file");
+  shift = 64;
+  for (uint64_t c = capacity; c > 1; c /= 2) --shift;
+  using_mapping = true;
+  bread(base + ".keys.bin", keys, "keys", capacity);
+  bread(base + ".pos.bin", positions, "positions", capacity);
+}
+
+void unique_kmers::save(const string & base) const {
+  const string saved = base + ".bin";
+  FILE * index = fopen(saved.c_str(), "wb");
+  if (index == nullptr)
+    throw Error("could not open unique index") << saved << "for writing";
+  bwrite(index, k, "k");
+  bwrite(index, capacity, "capacity");
+  bwrite(index, n_kmers, "n_kmers");
+  if (fclose(index) != 0) throw Error("problem closing unique index file");
+  bwrite(base + ".keys.bin", keys[0], "keys", capacity);
+  bwrite(base + ".pos.bin", positions[0], "positions", capacity);
+}
+
 longSA::longSA(const SAArgs & arguments)
     : SAArgs(arguments), using_mapping(false),
       ref(arguments), N(ref.N),  // S(ref.seq),
-      logN((uint64_t)(ceil(log(N) / log(2.0)))), Nm1(N - 1) {
+      logN((uint64_t)(ceil(log(N) / log(2.0)))), n_sa(N), Nm1(N - 1) {
   const time_t start_time = time(nullptr);
 
   // Index cache filename
@@ -102,14 +309,32 @@ longSA::longSA(const SAArgs & arguments)
   saved_index_stream << ref.ref_fasta << ".bin";
   saved_index_stream << "/rc" << ref.rcref;
   saved_index_stream << ".i" << sizeof(ANINT) << ".index";
+  const string full_base = saved_index_stream.str();
+  if (mask_length) saved_index_stream << ".mask" << mask_length;
   const string bin_base = saved_index_stream.str();
   saved_index_stream << ".bin";
   const string saved_index = saved_index_stream.str();
 
   const uint64_t fasta_size = file_size(ref.ref_fasta);
+  const string saved_rindex = bin_base + ".rindex.bin";
+  const string saved_salcp = bin_base + ".salcp.bin";
 
   // Load or create index
-  if (readable(saved_index)) {
+  SA = ISA = nullptr;
+  min_unique = nullptr;
+  if (rindex && readable(saved_rindex)) {
+    if (verbose) cerr << "# loading run-length BWT" << endl;
+    FILE * index = fopen(saved_rindex.c_str(), "rb");
+    if (index == nullptr)
+      throw Error("could not open") << saved_rindex << "for reading";
+    uint64_t fasta_saved_size;
+    bread(index, fasta_saved_size, "fasta_size");
+    if (fasta_size != fasta_saved_size)
+      throw Error("saved fasta size used for run-length BWT does not "
+                  "match current fasta size");
+    BWT.load(bin_base, index);
+    if (fclose(index) != 0) throw Error("problem closing run-length BWT");
+  } else if (readable(saved_index)) {
     if (verbose) cerr << "# loading index binary" << endl;
 
     FILE * index = fopen(saved_index.c_str(), "rb");
@@ -128,12 +353,57 @@ longSA::longSA(const SAArgs & arguments)
     bread(index, dummy, "logN");
     uint64_t SA_size;
     bread(index, SA_size, "SA_size");
+    n_sa = SA_size;
+    Nm1 = n_sa - 1;
 
     using_mapping = true;
-    bread(bin_base + ".sa.bin", SA, "SA", SA_size);
-    bread(bin_base + ".isa.bin", ISA, "ISA", SA_size);
-    LCP.load(bin_base, index);
+    const bool load_compressed = compressed && readable(bin_base + ".sa.z");
+    const unsigned int n_threads = n_cores();
+    const steady_clock::time_point load_start = steady_clock::now();
+    if (interleaved && readable(saved_salcp)) {
+      if (verbose) cerr << "# loading interleaved SA and LCP" << endl;
+      FILE * salcp = fopen(saved_salcp.c_str(), "rb");
+      if (salcp == nullptr)
+        throw Error("could not open") << saved_salcp << "for reading";
+      bread(salcp, fasta_saved_size, "fasta_size");
+      if (fasta_size != fasta_saved_size)
+        throw Error("saved fasta size used for interleaved index does not "
+                    "match current fasta size");
+      SALCP.load(bin_base, salcp);
+      if (fclose(salcp) != 0) throw Error("problem closing interleaved index");
+    } else if (load_compressed) {
+      read_packed(bin_base + ".sa.z", SA, SA_size, n_threads);
+      LCP.load_compressed(bin_base, index, n_threads);
+    } else {
+      bread(bin_base + ".sa.bin", SA, "SA", SA_size);
+      LCP.load(bin_base, index);
+    }
+    if (load_compressed)
+      read_packed(bin_base + ".isa.z", ISA, N, n_threads);
+    else
+      bread(bin_base + ".isa.bin", ISA, "ISA", N);
+    if (mask_length)
+      bread(bin_base + ".minunique.bin", min_unique, "min_unique", n_sa);
     if (fclose(index) != 0) throw Error("problem closing index file");
+    if (verbose && load_compressed)
+      cerr << "# decompressed index with " << n_threads << " threads in "
+           << duration<double>(steady_clock::now() - load_start).count()
+           << " seconds" << endl;
+  } else if (mask_length) {
+    // The full index is built and saved first if needed, and freed
+    // before masking, which reads it back from its files
+    if (!readable(full_base + ".bin")) {
+      SAArgs full_args(*this);
+      full_args.mask_length = 0;
+      full_args.lcplr = full_args.toptree = full_args.lock_index = false;
+      full_args.warm_threads = 0;
+      const longSA full(full_args);
+    }
+    if (verbose) cerr << "# masking index" << endl;
+    computeMasked(full_base, fasta_size,
+                  string(ref.ref_fasta) + ".bin/map.bin");
+    if (verbose) cerr << "# saving masked index" << endl;
+    save_index(bin_base, saved_index, fasta_size);
   } else {
     if (verbose) cerr << "# creating index from reference" << endl;
 
@@ -175,47 +445,341 @@ longSA::longSA(const SAArgs & arguments)
     LCP.init();
 
     if (verbose) cerr << "# saving index" << endl;
-
-    FILE * index = fopen(saved_index.c_str(), "wb");
+    save_index(bin_base, saved_index, fasta_size);
+  }
+  if (rindex && BWT.empty()) {
+    if (verbose) cerr << "# computing run-length BWT" << endl;
+    BWT.build(ref, SA);
+    FILE * index = fopen(saved_rindex.c_str(), "wb");
     if (index == nullptr)
-      throw Error("could not open index") << saved_index << "for writing";
+      throw Error("could not open") << saved_rindex << "for writing";
     bwrite(index, fasta_size, "fasta_size");
-    bwrite(index, logN, "logN");
-    bwrite(index, Nm1, "Nm1");
-    bwrite(index, N, "SA_size");
-    bwrite(bin_base + ".sa.bin", SA[0], "SA", N);
-    bwrite(bin_base + ".isa.bin", ISA[0], "ISA", N);
-    LCP.save(bin_base, index);
-    if (fclose(index) != 0)
-      throw Error("problem closing index file");
+    BWT.save(bin_base, index);
+    if (fclose(index) != 0) throw Error("problem closing run-length BWT");
+  }
+  if (compressed && SA && !readable(bin_base + ".sa.z")) {
+    if (verbose) cerr << "# saving compressed index" << endl;
+    write_packed(bin_base + ".sa.z", SA, n_sa);
+    write_packed(bin_base + ".isa.z", ISA, N);
+    LCP.save_compressed(bin_base);
+  }
+  if (interleaved && SALCP.empty()) {
+    if (verbose) cerr << "# computing interleaved SA and LCP" << endl;
+    SALCP.build(SA, LCP, n_sa);
+    FILE * salcp = fopen(saved_salcp.c_str(), "wb");
+    if (salcp == nullptr)
+      throw Error("could not open") << saved_salcp << "for writing";
+    bwrite(salcp, fasta_size, "fasta_size");
+    SALCP.save(bin_base, salcp);
+    if (fclose(salcp) != 0) throw Error("problem closing interleaved index");
+  }
+  if (rindex && verbose)
+    cerr << "# run-length BWT has " << BWT.runs() << " runs using "
+         << BWT.bytes() << " bytes, versus "
+         << N * (2 * sizeof(ANINT) + 1) << " for SA, ISA and LCP" << endl;
+
+  if (lcplr) {
+    const string saved_lcplr = bin_base + ".lcplr.bin";
+    if (readable(saved_lcplr)) {
+      if (verbose) cerr << "# loading LCP-LR arrays" << endl;
+      FILE * index = fopen(saved_lcplr.c_str(), "rb");
+      if (index == nullptr)
+        throw Error("could not open") << saved_lcplr << "for reading";
+      uint64_t fasta_saved_size;
+      bread(index, fasta_saved_size, "fasta_size");
+      uint64_t saved_n_sa;
+      bread(index, saved_n_sa, "n_sa");
+      if (fasta_size != fasta_saved_size || saved_n_sa != n_sa)
+        throw Error("saved fasta size or suffix count used for LCP-LR "
+                    "arrays does not match current index - remove")
+            << saved_lcplr;
+      LLCP.load(bin_base, index, "llcp");
+      RLCP.load(bin_base, index, "rlcp");
+      if (fclose(index) != 0) throw Error("problem closing LCP-LR file");
+    } else {
+      if (verbose) cerr << "# computing LCP-LR arrays" << endl;
+      LLCP.resize(n_sa);
+      RLCP.resize(n_sa);
+      LLCP.set(0, 0);
+      RLCP.set(0, 0);
+      LLCP.set(Nm1, 0);
+      RLCP.set(Nm1, 0);
+      computeLCPLR(0, Nm1);
+      LLCP.init();
+      RLCP.init();
+      FILE * index = fopen(saved_lcplr.c_str(), "wb");
+      if (index == nullptr)
+        throw Error("could not open") << saved_lcplr << "for writing";
+      bwrite(index, fasta_size, "fasta_size");
+      bwrite(index, n_sa, "n_sa");
+      LLCP.save(bin_base, index, "llcp");
+      RLCP.save(bin_base, index, "rlcp");
+      if (fclose(index) != 0) throw Error("problem closing LCP-LR file");
+    }
   }
+
+  if (toptree) {
+    const string saved_top = bin_base + ".toptree.bin";
+    if (readable(saved_top)) {
+      if (verbose) cerr << "# loading top tree" << endl;
+      FILE * index = fopen(saved_top.c_str(), "rb");
+      if (index == nullptr)
+        throw Error("could not open") << saved_top << "for reading";
+      uint64_t fasta_saved_size;
+      bread(index, fasta_saved_size, "fasta_size");
+      if (fasta_size != fasta_saved_size)
+        throw Error("saved fasta size used for top tree does not "
+                    "match current fasta size");
+      top.load(bin_base, index);
+      if (fclose(index) != 0) throw Error("problem closing top tree file");
+    } else {
+      if (verbose) cerr << "# computing top tree" << endl;
+      computeTopTree(top_tree::default_step);
+      FILE * index = fopen(saved_top.c_str(), "wb");
+      if (index == nullptr)
+        throw Error("could not open") << saved_top << "for writing";
+      bwrite(index, fasta_size, "fasta_size");
+      top.save(bin_base, index);
+      if (fclose(index) != 0) throw Error("problem closing top tree file");
+      if (verbose) benchmark_top_tree();
+    }
+    if (verbose) cerr << "# top tree has " << top.size() << " samples using "
+                      << top.size() * (sizeof(top_tree::node_t) +
+                                       sizeof(ANINT)) << " bytes" << endl;
+  }
+
+  if (unique_k) {
+    ostringstream unique_base;
+    unique_base << bin_base << ".u" << unique_k;
+    if (readable(unique_base.str() + ".bin")) {
+      if (verbose) cerr << "# loading unique k-mer index" << endl;
+      unique.load(unique_base.str());
+      const unsigned int saved_k = unique.kmer_length();
+      if (saved_k != unique_k)
+        throw Error("unique k-mer index has wrong k") << saved_k;
+    } else {
+      computeUnique();
+      if (verbose) cerr << "# saving unique k-mer index" << endl;
+      unique.save(unique_base.str());
+    }
+    if (verbose) cerr << "# " << unique.size() << " unique " << unique_k
+                      << "-mers in reference" << endl;
+  }
+
   const time_t end_time = time(nullptr);
   if (verbose) cerr << "# constructed index in "
                     << end_time - start_time << " seconds" << endl;
+  if (verbose && loaded_bytes)
+    cerr << "# read " << loaded_bytes / 1e9 << " GB of reference and index"
+         << " with " << load_threads << " threads"
+         << (direct_io ? " and direct I/O" : "") << " in " << load_seconds
+         << " seconds at " << loaded_bytes / 1e9 / load_seconds << " GB/s"
+         << endl;
+
+  warm_up();
+}
 
-  const bool exercise = false;
-  if (exercise) {
-    if (verbose) cerr << "# exercising memory mapped file" << endl;
-    uint64_t temp = 0;
-    for (uint64_t i = 0; i < N; i += 4096)
-      temp += ref[i];
-    for (uint64_t i = 0; i < N; i += 4096)
-      temp += SA[i];
-    for (uint64_t i = 0; i < N; i += 4096)
-      temp += ISA[i];
-    for (uint64_t i = 0; i < N; i += 4096)
-      temp += LCP[i];
-    if (verbose) cerr << "# done exercising memory mapped file" << endl;
+// Under -cached the index is mapped without MAP_POPULATE, so pages are
+// faulted in by the first reads unless warmed up here in parallel.
+// Locking keeps co-located jobs from evicting the index mid-run.
+void longSA::warm_up() const {
+  struct section {
+    const char * name;
+    const void * data;
+    uint64_t bytes;
+  };
+  const section sections[] = {
+    {"seq", ref.seq, ref.seq ? N : 0},
+    {"SA", SA, SA ? n_sa * sizeof(ANINT) : 0},
+    {"ISA", ISA, ISA ? N * sizeof(ANINT) : 0},
+    {"LCP", LCP.data(), LCP.bytes()},
+    {"LCP overflow", LCP.overflow(), LCP.overflow_bytes()},
+    {"SA/LCP blocks", SALCP.data(), SALCP.bytes()},
+    {"SA/LCP overflow", SALCP.overflow(), SALCP.overflow_bytes()},
+    {"unique k-mer keys", unique.key_data(), unique.key_bytes()},
+    {"unique k-mer positions", unique.position_data(),
+     unique.position_bytes()},
+    {"top tree nodes", top.node_data(), top.node_bytes()},
+    {"top tree ranks", top.rank_data(), top.rank_bytes()},
+    {"LLCP", LLCP.data(), LLCP.bytes()},
+    {"LLCP overflow", LLCP.overflow(), LLCP.overflow_bytes()},
+    {"RLCP", RLCP.data(), RLCP.bytes()},
+    {"RLCP overflow", RLCP.overflow(), RLCP.overflow_bytes()},
+    {"r-index run starts", BWT.run_starts(), BWT.run_bytes()},
+    {"r-index run counts", BWT.run_cums(), BWT.run_bytes()},
+    {"r-index run SA ends", BWT.run_sa_ends(), BWT.run_bytes()},
+    {"r-index buckets", BWT.bucket_data(), BWT.bucket_bytes()}};
+
+  if (verbose)
+    for (const section & s : sections)
+      if (s.bytes)
+        cerr << "# " << s.name << " " << resident_bytes(s.data, s.bytes) / 1e6
+             << " of " << s.bytes / 1e6 << " MB resident" << endl;
+
+  if (warm_threads) {
+    const steady_clock::time_point warm_start = steady_clock::now();
+    for (const section & s : sections)
+      touch_pages(s.data, s.bytes, warm_threads);
+    if (verbose)
+      cerr << "# warmed up index with " << warm_threads << " threads in "
+           << duration<double>(steady_clock::now() - warm_start).count()
+           << " seconds" << endl;
+  }
+
+  if (lock_index)
+    for (const section & s : sections)
+      if (s.bytes && mlock(s.data, s.bytes))
+        throw Error("could not lock") << s.name
+                                      << "in memory - check ulimit -l";
+
+  if (verbose) {
+    uint64_t major, minor;
+    page_faults(major, minor);
+    cerr << "# index ready " << seconds_since_start()
+         << " seconds after start, with " << major << " major and "
+         << minor << " minor page faults" << endl;
   }
 }
 
 longSA::~longSA() {
   if (memory_mapped && using_mapping) {
-    if (munmap(SA, N * sizeof(ANINT))) throw Error("SA Memory unmap failure");
-    if (munmap(ISA, N * sizeof(ANINT))) throw Error("ISA Memory unmap failure");
+    if (SA && munmap(SA, n_sa * sizeof(ANINT)))
+      throw Error("SA Memory unmap failure");
+    if (ISA && munmap(ISA, N * sizeof(ANINT)))
+      throw Error("ISA Memory unmap failure");
+    if (min_unique) munmap(min_unique, n_sa);
   } else {
     free(SA);
     free(ISA);
+    free(min_unique);
+  }
+}
+
+void longSA::save_index(const string & bin_base, const string & saved_index,
+                        const uint64_t fasta_size) const {
+  FILE * index = fopen(saved_index.c_str(), "wb");
+  if (index == nullptr)
+    throw Error("could not open index") << saved_index << "for writing";
+  bwrite(index, fasta_size, "fasta_size");
+  bwrite(index, logN, "logN");
+  bwrite(index, Nm1, "Nm1");
+  bwrite(index, n_sa, "SA_size");
+  bwrite(bin_base + ".sa.bin", SA[0], "SA", n_sa);
+  bwrite(bin_base + ".isa.bin", ISA[0], "ISA", N);
+  if (min_unique)
+    bwrite(bin_base + ".minunique.bin", min_unique[0], "min_unique", n_sa);
+  LCP.save(bin_base, index);
+  if (fclose(index) != 0)
+    throw Error("problem closing index file");
+}
+
+// A MAM is unique, so it cannot start where the shortest unique
+// match is longer than the read, or where there is none (0 in the
+// mappability file).  Dropping those suffixes removes no MAM of reads
+// up to mask_length long.  Dropping can make a shorter, repeated match
+// look unique, so the minimum unique length of each kept suffix is
+// saved for MAM to discard matches shorter than it.  LCP between kept
+// suffixes is the minimum LCP over the dropped ones between them.
+void longSA::computeMasked(const string & full_base, const uint64_t fasta_size,
+                           const string & map_file) {
+  if (!readable(map_file))
+    throw Error("could not read mappability file") << map_file
+        << "- make it with -rcref -mappability";
+  const uint64_t header = 2;
+  uint64_t n_forward = 0;
+  for (uint64_t chr = 0; chr < ref.sizes.size(); chr += 2)
+    n_forward += ref.sizes[chr];
+  if (file_size(map_file) != header + 2 * n_forward)
+    throw Error("mappability file size does not match reference")
+        << map_file;
+  MappedFile map(map_file);
+  const unsigned char * lengths =
+      reinterpret_cast<const unsigned char *>(map.begin()) + header;
+
+  // Minimum unique length where kept, 0 where dropped
+  vector<unsigned char> kept_length(N);
+  for (uint64_t chr = 0; chr < ref.sizes.size(); chr += 2) {
+    const uint64_t start = ref.startpos[chr];
+    const uint64_t size_ = ref.sizes[chr];
+    for (uint64_t i = 0; i != size_; ++i) {
+      const unsigned int left = *lengths++;
+      const unsigned int right = *lengths++;
+      kept_length[start + i] = right <= mask_length ? right : 0;
+      kept_length[start + 2 * size_ - i] = left <= mask_length ? left : 0;
+    }
+  }
+  map.unmap();
+
+  // Full SA and LCP, read in order from the saved full index
+  const string full_index = full_base + ".bin";
+  FILE * index = fopen(full_index.c_str(), "rb");
+  if (index == nullptr)
+    throw Error("could not open index") << full_index << "for reading";
+  uint64_t fasta_saved_size;
+  bread(index, fasta_saved_size, "fasta_size");
+  if (fasta_size != fasta_saved_size)
+    throw Error("saved fasta size used for index does not "
+                "match current fasta size") << full_index;
+  uint64_t dummy;
+  bread(index, dummy, "logN");
+  bread(index, dummy, "Nm1");
+  uint64_t full_size;
+  bread(index, full_size, "SA_size");
+  if (full_size != N)
+    throw Error("full index to mask is itself masked") << full_index;
+  vec_uchar full_LCP;
+  full_LCP.load(full_base, index);
+  if (fclose(index) != 0) throw Error("problem closing index file");
+  MappedFile full_SA_file(full_base + ".sa.bin");
+  if (full_SA_file.size() != N * sizeof(ANINT))
+    throw Error("full suffix array size does not match reference")
+        << full_SA_file.name();
+  full_SA_file.sequential();
+  const ANINT * const full_SA =
+      reinterpret_cast<const ANINT *>(full_SA_file.begin());
+
+  n_sa = 0;
+  for (uint64_t i = 0; i != N; ++i) n_sa += kept_length[i] != 0;
+  Nm1 = n_sa - 1;
+  if ((SA = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * n_sa))) == nullptr)
+    throw Error("SA malloc error");
+  if ((ISA = reinterpret_cast<ANINT *>(malloc(sizeof(ANINT) * N))) == nullptr)
+    throw Error("ISA malloc error");
+  if ((min_unique = reinterpret_cast<unsigned char *>(
+          malloc(std::max<uint64_t>(n_sa, 1)))) == nullptr)
+    throw Error("min_unique malloc error");
+  LCP.resize(n_sa);
+  uint64_t j = 0;
+  uint64_t lcp_since_kept = 0;
+  for (uint64_t i = 0; i != N; ++i) {
+    const uint64_t pos = full_SA[i];
+    const uint64_t lcp_i = full_LCP[i];
+    if (i == 0 || lcp_i < lcp_since_kept) lcp_since_kept = lcp_i;
+    if (kept_length[pos]) {
+      SA[j] = pos;
+      ISA[pos] = j;
+      min_unique[j] = kept_length[pos];
+      LCP.set(j, j ? lcp_since_kept : 0);
+      lcp_since_kept = numeric_limits<uint64_t>::max();
+      ++j;
+    } else {
+      ISA[pos] = n_sa;
+    }
+  }
+  full_SA_file.unmap();
+  LCP.init();
+
+  if (verbose) {
+    const uint64_t full_bytes = N * (sizeof(ANINT) + 1) +
+        full_LCP.overflow_bytes();
+    const uint64_t masked_bytes = n_sa * (sizeof(ANINT) + 2) +
+        LCP.overflow_bytes();
+    cerr << "# masked index keeps " << n_sa << " of " << N
+         << " suffixes, SA, LCP and minimum unique lengths use "
+         << masked_bytes << " bytes versus full SA and LCP "
+         << full_bytes << " (" << 100.0 * masked_bytes / full_bytes << "%)"
+         << endl;
   }
 }
 
@@ -236,13 +800,127 @@ void longSA::computeLCP() {
   }
 }
 
+// A k-mer starting at reference position i is unique if the
+// suffix at i shares fewer than k characters with its SA neighbors.
+// Two passes over the reference: count, then fill the hash table.
+void longSA::computeUnique() {
+  if (verbose) cerr << "# finding unique " << unique_k << "-mers" << endl;
+  const uint64_t mask = unique_k == 32 ? numeric_limits<uint64_t>::max() :
+      (1ULL << (2 * unique_k)) - 1;
+  for (unsigned int pass = 0; pass != 2; ++pass) {
+    uint64_t n_unique = 0;
+    uint64_t code = 0;
+    uint64_t valid = 0;  // run length of acgt bases ending at i
+    for (uint64_t i = 0; i != N; ++i) {
+      switch (ref[i]) {
+        case 'a': code = (code << 2) & mask; break;
+        case 'c': code = ((code << 2) | 1) & mask; break;
+        case 'g': code = ((code << 2) | 2) & mask; break;
+        case 't': code = ((code << 2) | 3) & mask; break;
+        default: valid = 0; continue;
+      }
+      if (++valid < unique_k) continue;
+      const uint64_t pos = i + 1 - unique_k;
+      const uint64_t sa_pos = ISA[pos];
+      if (lcp(sa_pos) < unique_k &&
+          (sa_pos + 1 == n_sa || lcp(sa_pos + 1) < unique_k)) {
+        if (pass)
+          unique.insert(code, pos);
+        else
+          ++n_unique;
+      }
+    }
+    if (!pass) unique.resize(unique_k, n_unique);
+  }
+}
+
+// Each midpoint m of the implicit binary search tree over SA is the
+// midpoint of exactly one interval (l, r), so LLCP and RLCP are indexed
+// by m.  lcp(l, r) is the minimum of LCP over (l, r].
+uint64_t longSA::computeLCPLR(const uint64_t l, const uint64_t r) {
+  if (l >= r) return 0;  // one suffix, no interval to split
+  if (r - l == 1) return lcp(r);
+  const uint64_t m = (l + r) / 2;
+  const uint64_t left = computeLCPLR(l, m);
+  const uint64_t right = computeLCPLR(m, r);
+  LLCP.set(m, left);
+  RLCP.set(m, right);
+  return min(left, right);
+}
+
+void longSA::computeTopTree(const uint64_t step) {
+  vector<top_tree::node_t> sorted;
+  sorted.reserve(N / step + 1);
+  for (uint64_t i = 0; i < n_sa; i += step) {
+    const uint64_t pos = sa(i);
+    sorted.push_back(top_tree::make_key(ref.seq + pos, N - pos));
+    if (sorted.size() > 1 && sorted.back() < sorted[sorted.size() - 2])
+      throw Error("suffix array order does not match top tree keys");
+  }
+  top.build(sorted, step, n_sa);
+}
+
+// Searches for reference substrings from random positions, to depth
+// key_length, both directly and starting from the top tree range.
+void longSA::benchmark_top_tree() const {
+  const uint64_t n_queries = 200000;
+  const uint64_t length = 2 * top_tree::key_length;
+  if (N < 2 * length) return;
+  vector<string> queries;
+  queries.reserve(n_queries);
+  uint64_t seed = 12345;
+  while (queries.size() != n_queries) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    const uint64_t pos = (seed >> 16) % (N - length);
+    queries.push_back(string(ref.seq + pos, length));
+  }
+  uint64_t work = 0;
+  vector<interval_t> direct(n_queries);
+  vector<interval_t> narrowed(n_queries);
+  const steady_clock::time_point direct_start = steady_clock::now();
+  for (uint64_t q = 0; q != n_queries; ++q) {
+    direct[q] = interval_t(0, Nm1, 0);
+    traverse(queries[q], 0, direct[q], top_tree::key_length, work);
+  }
+  const steady_clock::time_point top_start = steady_clock::now();
+  for (uint64_t q = 0; q != n_queries; ++q) {
+    narrowed[q] = interval_t(0, Nm1, 0);
+    top.narrow(queries[q].data(), length, narrowed[q].start, narrowed[q].end);
+    traverse(queries[q], 0, narrowed[q], top_tree::key_length, work);
+  }
+  const steady_clock::time_point top_stop = steady_clock::now();
+  uint64_t n_differ = 0;
+  for (uint64_t q = 0; q != n_queries; ++q)
+    if (direct[q].depth == top_tree::key_length &&
+        (direct[q].start != narrowed[q].start ||
+         direct[q].end != narrowed[q].end)) ++n_differ;
+  if (n_differ) throw Error("top tree search mismatch for") << n_differ;
+  const double ns = 1.0e9 / n_queries;
+  cerr << "# top tree search to depth " << top_tree::key_length << " takes "
+       << duration<double>(top_stop - top_start).count() * ns
+       << " ns versus "
+       << duration<double>(top_start - direct_start).count() * ns
+       << " ns per query without it" << endl;
+}
+
+// The range from the top tree only holds the whole interval of the
+// pattern to depth key_length or more, so shallower matches are redone.
+void longSA::top_search(const string &P, const uint64_t prefix,
+                        interval_t &cur, uint64_t & work) const {
+  interval_t match(0, Nm1, 0);
+  if (!top.narrow(&P[prefix], P.length() - prefix, match.start, match.end))
+    return;
+  traverse(P, prefix, match, P.length(), work);
+  if (match.depth >= top_tree::key_length) cur = match;
+}
+
 // Binary search for left boundry of interval.
 uint64_t longSA::bsearch_left(const char c, const uint64_t i,
                                    uint64_t l, uint64_t r) const {
-  if (c == ref[SA[l]+i]) return l;
+  if (c == ref[sa(l)+i]) return l;
   while (r > l + 1) {
     const uint64_t m = (l+r) / 2;
-    if (c <= ref[SA[m] + i])
+    if (c <= ref[sa(m) + i])
       r = m;
     else
       l = m;
@@ -253,10 +931,10 @@ uint64_t longSA::bsearch_left(const char c, const uint64_t i,
 // Binary search for right boundry of interval.
 uint64_t longSA::bsearch_right(const char c, const uint64_t i,
                                     uint64_t l, uint64_t r) const {
-  if (c == ref[SA[r]+i]) return r;
+  if (c == ref[sa(r)+i]) return r;
   while (r - l > l + 1) {
     const uint64_t m = (l+r) / 2;
-    if (c < ref[SA[m] + i])
+    if (c < ref[sa(m) + i])
       r = m;
     else
       l = m;
@@ -267,8 +945,8 @@ uint64_t longSA::bsearch_right(const char c, const uint64_t i,
 // Simple top down traversal of a suffix array.
 bool longSA::top_down(const char c, const uint64_t i,
                       uint64_t &start, uint64_t &end) const {
-  if (c < ref[SA[start]+i]) return false;
-  if (c > ref[SA[end]+i]) return false;
+  if (c < ref[sa(start)+i]) return false;
+  if (c > ref[sa(end)+i]) return false;
   const uint64_t l = bsearch_left(c, i, start, end);
   const uint64_t l2 = bsearch_right(c, i, start, end);
   start = l;
@@ -280,8 +958,15 @@ bool longSA::top_down(const char c, const uint64_t i,
 // NO childtab as in the enhanced suffix array (ESA).
 bool longSA::search(const string &P, uint64_t &start,
                     uint64_t &end) const {
+  if (lcplr) {
+    uint64_t before, at;
+    start = lcplr_bound(P.data(), P.length(), false, before, at);
+    end = lcplr_bound(P.data(), P.length(), true, before, at);
+    if (end-- == start) return false;
+    return true;
+  }
   start = 0;
-  end = N - 1;
+  end = Nm1;
   uint64_t i = 0;
   while (i < P.length()) {
     if (top_down(P[i], i, start, end) == false) {
@@ -292,17 +977,145 @@ bool longSA::search(const string &P, uint64_t &start,
   return true;
 }
 
+// Length of the common prefix of a and b, up to max_len characters.
+// Compares a 64-bit word at a time and locates the first mismatching
+// byte in a word with count trailing zeros (little endian order).
+inline uint64_t common_prefix(const char * a, const char * b,
+                              const uint64_t max_len) {
+  uint64_t len = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len + sizeof(uint64_t) <= max_len) {
+    uint64_t wa, wb;
+    memcpy(&wa, a + len, sizeof(uint64_t));
+    memcpy(&wb, b + len, sizeof(uint64_t));
+    const uint64_t diff = wa ^ wb;
+    if (diff) return len + (__builtin_ctzll(diff) >> 3);
+    len += sizeof(uint64_t);
+  }
+#endif
+  while (len != max_len && a[len] == b[len]) ++len;
+  return len;
+}
+
+int longSA::compare(const char * X, const uint64_t n, const uint64_t i,
+                    uint64_t & h) const {
+  const uint64_t pos = sa(i);
+  h += common_prefix(X + h, ref.seq + pos + h, min(n, N - pos) - h);
+  if (h == n) return 0;
+  if (pos + h == N) return 1;
+  return X[h] < ref[pos + h] ? -1 : 1;
+}
+
+// Manber and Myers binary search.  Whichever of the interval ends
+// shares more characters with X decides which LCP-LR array is used: if
+// the midpoint shares more or less with that end than X does, the
+// comparison is already known.  Only when they tie are characters
+// compared, starting past the known common prefix, so a search costs
+// O(n + log N) character comparisons.
+uint64_t longSA::lcplr_bound(const char * X, const uint64_t n,
+                             const bool right, uint64_t & lcp_before,
+                             uint64_t & lcp_at) const {
+  uint64_t l = 0;
+  uint64_t r = Nm1;
+  uint64_t hl = 0;
+  uint64_t hr = 0;
+  int c = compare(X, n, l, hl);
+  if (right ? c < 0 : c <= 0) {
+    lcp_before = 0;
+    lcp_at = hl;
+    return 0;
+  }
+  c = compare(X, n, r, hr);
+  if (!(right ? c < 0 : c <= 0)) {
+    lcp_before = hr;
+    lcp_at = 0;
+    return n_sa;
+  }
+  // X sorts after l and before r
+  while (r - l > 1) {
+    const uint64_t m = (l + r) / 2;
+    uint64_t h;
+    if (hl >= hr) {
+      const uint64_t lm = LLCP[m];
+      if (lm > hl) {
+        l = m;
+        continue;
+      } else if (lm < hl) {
+        r = m;
+        hr = lm;
+        continue;
+      }
+      h = hl;
+    } else {
+      const uint64_t mr = RLCP[m];
+      if (mr > hr) {
+        r = m;
+        continue;
+      } else if (mr < hr) {
+        l = m;
+        hl = mr;
+        continue;
+      }
+      h = hr;
+    }
+    c = compare(X, n, m, h);
+    if (right ? c < 0 : c <= 0) {
+      r = m;
+      hr = h;
+    } else {
+      l = m;
+      hl = h;
+    }
+  }
+  lcp_before = hl;
+  lcp_at = hr;
+  return r;
+}
+
+// The longest match of P[prefix...] is the larger lcp with its
+// neighbors in suffix order.  Its interval is grown from that neighbor
+// using LCP, or found with two more searches for just the matched part
+// if it is too large to scan.
+void longSA::root_search(const string &P, const uint64_t prefix,
+                         interval_t &cur, uint64_t & work) const {
+  const char * X = &P[prefix];
+  uint64_t before, at;
+  const uint64_t i = lcplr_bound(X, P.length() - prefix, false, before, at);
+  const uint64_t depth = max(before, at);
+  if (depth == 0) return;
+  const uint64_t neighbor = at >= before ? i : i - 1;
+  interval_t match(neighbor, neighbor, depth);
+  if (!expand_link(&match, work)) {
+    match.start = lcplr_bound(X, depth, false, before, at);
+    match.end = lcplr_bound(X, depth, true, before, at) - 1;
+  }
+  cur = match;
+}
+
 // Traverse pattern P starting from a given prefix and interval
 // until mismatch or min_len characters reached.
 void longSA::traverse(const string &P, const uint64_t prefix,
-                      interval_t &cur, const ANINT min_len) const {
+                      interval_t &cur, const ANINT min_len,
+                      uint64_t & work) const {
   if (cur.depth >= min_len) return;
 
   while (prefix+cur.depth < P.length()) {
+    // A single suffix left - extend it directly against the reference
+    if (cur.start == cur.end) {
+      const uint64_t ref_pos = sa(cur.start) + cur.depth;
+      const uint64_t max_len = min(
+          min(P.length() - prefix, static_cast<uint64_t>(min_len)) -
+          cur.depth, N - ref_pos);
+      cur.depth += common_prefix(&P[prefix + cur.depth], ref.seq + ref_pos,
+                                 max_len);
+      return;
+    }
+
     uint64_t start = cur.start;
     uint64_t end = cur.end;
     // If we reach a mismatch, stop.
-    if (top_down_faster(P[prefix+cur.depth], cur.depth, start, end) == false)
+    if (top_down_faster(P[prefix+cur.depth], cur.depth, start, end,
+                        work) == false)
       return;
 
     // Advance to next interval.
@@ -320,12 +1133,14 @@ void longSA::traverse(const string &P, const uint64_t prefix,
 // for the wordSA implementation from the following paper: Ferragina
 // and Fischer. Suffix Arrays on Words. CPM 2007.
 bool longSA::top_down_faster(const char c, const uint64_t i,
-                             uint64_t &start, uint64_t &end) const {
+                             uint64_t &start, uint64_t &end,
+                             uint64_t & work) const {
+  work += 2;
   uint64_t l, r, m, r2 = end, l2 = start;
   int64_t vgl;
   bool found = false;
-  const int64_t cmp_with_first = (int64_t)c - (int64_t)ref[SA[start]+i];
-  const int64_t cmp_with_last = (int64_t)c - (int64_t)ref[SA[end]+i];
+  const int64_t cmp_with_first = (int64_t)c - (int64_t)ref[sa(start)+i];
+  const int64_t cmp_with_last = (int64_t)c - (int64_t)ref[sa(end)+i];
   if (cmp_with_first < 0) {
     l = start + 1;
     l2 = start;  // pattern doesn't occur!
@@ -343,7 +1158,8 @@ bool longSA::top_down_faster(const char c, const uint64_t i,
     } else {
       while (r > l + 1) {
         m = (l+r) / 2;
-        vgl = (int64_t)c - (int64_t)ref[SA[m] + i];
+        ++work;
+        vgl = (int64_t)c - (int64_t)ref[sa(m) + i];
         if (vgl <= 0) {
           if (!found && vgl == 0) {
             found = true;
@@ -366,7 +1182,8 @@ bool longSA::top_down_faster(const char c, const uint64_t i,
     } else {
       while (r2 > l2 + 1) {
         m = (l2 + r2) / 2;
-        vgl = (int64_t)c - (int64_t)ref[SA[m] + i];
+        ++work;
+        vgl = (int64_t)c - (int64_t)ref[sa(m) + i];
         if (vgl < 0)
           r2 = m;
         else
@@ -379,16 +1196,28 @@ bool longSA::top_down_faster(const char c, const uint64_t i,
   return l <= l2;
 }
 
+// The SA interval of a unique k-mer is a single suffix, so a search
+// starting at the root can skip directly to depth k.
+void longSA::seed(const string &P, const uint64_t prefix,
+                  interval_t &cur) const {
+  if (unique.empty() || prefix + unique.kmer_length() > P.length()) return;
+  const ANINT pos = unique.find(&P[prefix]);
+  if (pos == unique_kmers::empty_slot) return;
+  cur.start = cur.end = ISA[pos];
+  cur.depth = unique.kmer_length();
+}
+
 // Suffix link simulation using ISA/LCP heuristic.
-bool longSA::suffixlink(interval_t * m) const {
+bool longSA::suffixlink(interval_t * m, uint64_t & work) const {
   if (m->depth <= 1) {
     m->depth = 0;
     return false;
   }
   --m->depth;
-  m->start = ISA[SA[m->start] + 1];
-  m->end = ISA[SA[m->end] + 1];
-  return expand_link(m);
+  m->start = ISA[sa(m->start) + 1];
+  m->end = ISA[sa(m->end) + 1];
+  if (m->start == n_sa || m->end == n_sa) return false;  // masked
+  return expand_link(m, work);
 }
 
 // For a given offset in the prefix k, find all MEMs.
@@ -396,38 +1225,38 @@ void longSA::findMEM(Aligner & query) const {
   const string & P = query();
   // Offset all intervals at different start points.
   uint64_t prefix = 1;
-  interval_t mli(0, N - 1, 0);  // min length interval
-  interval_t xmi(0, N - 1, 0);  // max match interval
+  interval_t mli(0, Nm1, 0);  // min length interval
+  interval_t xmi(0, Nm1, 0);  // max match interval
 
   // Right-most match used to terminate search.
-  while (prefix <= P.length()) {
+  while (prefix <= P.length() && !query.out_of_budget()) {
     // Traverse until minimum length matched.
-    traverse(P, prefix, mli, query.min_len);
+    traverse(P, prefix, mli, query.min_len, query.work);
     if (mli.depth > xmi.depth) xmi = mli;
     if (mli.depth <= 1) {
-      mli.reset(N - 1);
-      xmi.reset(N - 1);
+      mli.reset(Nm1);
+      xmi.reset(Nm1);
       ++prefix;
       continue;
     }
 
     if (mli.depth >= query.min_len) {
-      traverse(P, prefix, xmi, P.length());  // Traverse until mismatch.
+      traverse(P, prefix, xmi, P.length(), query.work);  // Until mismatch.
       collectMEMs(query, prefix, mli, xmi);  // Using LCP to find MEM length.
       // When using ISA/LCP trick, depth = depth - 1. prefix += 1.
       ++prefix;
-      if ( suffixlink(&mli) == false ) {
-        mli.reset(N - 1);
-        xmi.reset(N - 1);
+      if ( suffixlink(&mli, query.work) == false ) {
+        mli.reset(Nm1);
+        xmi.reset(Nm1);
         continue;
       }
-      suffixlink(&xmi);
+      suffixlink(&xmi, query.work);
     } else {
       // When using ISA/LCP trick, depth = depth - 1. prefix += 1.
       ++prefix;
-      if ( suffixlink(&mli) == false ) {
-        mli.reset(N - 1);
-        xmi.reset(N - 1);
+      if ( suffixlink(&mli, query.work) == false ) {
+        mli.reset(Nm1);
+        xmi.reset(Nm1);
         continue; }
       xmi = mli;
     }
@@ -461,29 +1290,36 @@ inline void longSA::find_Lmaximal(
 void longSA::collectMEMs(Aligner & query, const uint64_t prefix,
                          const interval_t mli, interval_t xmi) const {
   // All of the suffixes in xmi's interval are right maximal.
-  for (uint64_t i = xmi.start; i <= xmi.end; ++i)
-    find_Lmaximal(query, prefix, SA[i], xmi.depth);
+  for (uint64_t i = xmi.start; i <= xmi.end; ++i) {
+    if (query.out_of_budget()) return;
+    ++query.work;
+    find_Lmaximal(query, prefix, sa(i), xmi.depth);
+  }
 
   if (mli.start == xmi.start && mli.end == xmi.end) return;
 
   while (xmi.depth >= mli.depth) {
     // Attempt to "unmatch" xmi using LCP information.
-    if (xmi.end+1 < N)
-      xmi.depth = max(LCP[xmi.start], LCP[xmi.end+1]);
+    if (xmi.end+1 < n_sa)
+      xmi.depth = max(lcp(xmi.start), lcp(xmi.end+1));
     else
-      xmi.depth = LCP[xmi.start];
+      xmi.depth = lcp(xmi.start);
 
     // If unmatched XMI is > matched depth from mli, then examine rmems.
     if (xmi.depth >= mli.depth) {
       // Scan RMEMs to the left, check their left maximality..
-      while (LCP[xmi.start] >= xmi.depth) {
+      while (lcp(xmi.start) >= xmi.depth) {
+        if (query.out_of_budget()) return;
         --xmi.start;
-        find_Lmaximal(query, prefix, SA[xmi.start], xmi.depth);
+        ++query.work;
+        find_Lmaximal(query, prefix, sa(xmi.start), xmi.depth);
       }
       // Find RMEMs to the right, check their left maximality.
-      while (xmi.end+1 < N && LCP[xmi.end+1] >= xmi.depth) {
+      while (xmi.end+1 < n_sa && lcp(xmi.end+1) >= xmi.depth) {
+        if (query.out_of_budget()) return;
         ++xmi.end;
-        find_Lmaximal(query, prefix, SA[xmi.end], xmi.depth);
+        ++query.work;
+        find_Lmaximal(query, prefix, sa(xmi.end), xmi.depth);
       }
     }
   }
@@ -501,40 +1337,92 @@ struct by_ref {
 // Finds maximal almost-unique matches (MAMs) These can repeat in the
 // given query pattern P, but occur uniquely in the indexed reference S.
 void longSA::MAM(Aligner & query) const {
+  if (rindex) {
+    BWT.MAM(query, ref);
+    return;
+  }
+  if (seed_stride > 1) {
+    strided_MAM(query);
+    return;
+  }
   const string &P = query();
-  interval_t cur(0, N - 1, 0);
+  interval_t cur(0, Nm1, 0);
   uint64_t prefix = 0;
-  while (prefix < P.length()) {
+  while (prefix < P.length() && !query.out_of_budget()) {
     // Traverse SA top down until mismatch or full string is matched.
-    traverse(P, prefix, cur, P.length());
+    if (cur.depth == 0) seed(P, prefix, cur);
+    if (cur.depth == 0 && lcplr) root_search(P, prefix, cur, query.work);
+    if (cur.depth == 0 && toptree) top_search(P, prefix, cur, query.work);
+    traverse(P, prefix, cur, P.length(), query.work);
     if (cur.depth <= 1) {
       cur.depth = 0;
       cur.start = 0;
-      cur.end = N - 1;
+      cur.end = Nm1;
       ++prefix;
       continue;
     }
-    if (cur.size() == 1 && cur.depth >= query.min_len) {
-      if (is_leftmaximal(P, prefix, SA[cur.start])) {
+    if (cur.size() == 1 && cur.depth >= query.min_len &&
+        !masked_repeat(cur.start, cur.depth)) {
+      if (is_leftmaximal(P, prefix, sa(cur.start))) {
         // Yes, it's a MAM.
-        query.process_match(match_t(SA[cur.start], prefix, cur.depth));
+        query.process_match(match_t(sa(cur.start), prefix, cur.depth));
       }
     }
     do {
       cur.depth = cur.depth-1;
-      cur.start = ISA[SA[cur.start] + 1];
-      cur.end = ISA[SA[cur.end] + 1];
+      cur.start = ISA[sa(cur.start) + 1];
+      cur.end = ISA[sa(cur.end) + 1];
       ++prefix;
-      if ( cur.depth == 0 || expand_link(&cur) == false ) {
+      if (cur.depth == 0 || cur.start == n_sa || cur.end == n_sa ||
+          expand_link(&cur, query.work) == false) {
         cur.depth = 0;
         cur.start = 0;
-        cur.end = N - 1;
+        cur.end = Nm1;
         break;
       }
     } while (cur.depth > 0 && cur.size() == 1);
   }
 }
 
+struct by_query {
+  bool operator() (const match_t &a, const match_t &b) const {
+    return a.query < b.query;
+  }
+};
+
+// A unique longest match from an offset, extended to the left while it
+// matches, is the MAM that MAM would report at its new start.  A MAM of
+// length at least min_len + seed_stride - 1 holds an offset in its
+// first seed_stride positions, and is found unless the rest of it from
+// that offset also occurs elsewhere in the reference.
+void longSA::strided_MAM(Aligner & query) const {
+  const string &P = query();
+  vector<match_t> & found = query.scratch_matches();
+  for (uint64_t prefix = 0; prefix < P.length() && !query.out_of_budget();
+       prefix += seed_stride) {
+    interval_t cur(0, Nm1, 0);
+    seed(P, prefix, cur);
+    if (cur.depth == 0 && lcplr) root_search(P, prefix, cur, query.work);
+    if (cur.depth == 0 && toptree) top_search(P, prefix, cur, query.work);
+    traverse(P, prefix, cur, P.length(), query.work);
+    if (cur.depth <= 1 || cur.size() != 1) continue;
+    uint64_t start = prefix;
+    uint64_t pos = sa(cur.start);
+    while (start && pos && P[start - 1] == ref[pos - 1]) {
+      --start;
+      --pos;
+    }
+    const uint64_t len = prefix + cur.depth - start;
+    if (len >= query.min_len && !masked_repeat(ISA[pos], len))
+      found.push_back(match_t(pos, start, len));
+  }
+  // Report in query order and once each, like MAM
+  sort(found.begin(), found.end(), by_query());
+  for (uint64_t m = 0; m != found.size(); ++m)
+    if (m == 0 || found[m].query != found[m - 1].query)
+      query.process_match(found[m]);
+}
+
 // Returns true if the position p1 in the query pattern and p2 in the
 // reference is left maximal.
 bool longSA::is_leftmaximal(const string &P, const uint64_t p1,
@@ -545,12 +1433,34 @@ bool longSA::is_leftmaximal(const string &P, const uint64_t p1,
     return P[p1-1] != ref[p2-1];
 }
 
+// Looks up sampled k-mers of the query in the unique k-mer index.
+// If the query matches the reference end to end at the position of
+// the first unique k-mer found, that match is the only MAM: any
+// later suffix of the query either also occurs elsewhere or is not
+// left maximal.  Otherwise leave the query to MAM.
+bool longSA::unique_MAM(Aligner & query) const {
+  const string & P = query();
+  const uint64_t k = unique.kmer_length();
+  if (P.length() < query.min_len || P.length() < k) return false;
+  for (uint64_t q = 0; q + k <= P.length(); q += k) {
+    const ANINT pos = unique.find(&P[q]);
+    if (pos == unique_kmers::empty_slot) continue;
+    if (pos < q || pos - q + P.length() > N) return false;
+    const uint64_t start = pos - q;
+    if (common_prefix(P.data(), ref.seq + start, P.length()) != P.length())
+      return false;
+    query.process_match(match_t(start, 0, P.length()));
+    return true;
+  }
+  return false;
+}
+
 // Maximal Unique Match (MUM)
 void longSA::MUM(Aligner & query) const {
   // Find unique MEMs.
   query.set_print(false);
   MAM(query);
-  vector<match_t> matches;
+  vector<match_t> & matches = query.scratch_matches();
   query.forget(matches);
   query.set_print(true);
 
@@ -626,7 +1536,7 @@ void longSA::show(Out & output, const bool bin ) const {
   uint64_t ref_seq = 0;
   if (verbose) cerr << "# " << ref.descr[ref_seq] << " ";
   for (uint64_t i = 0; i != N; ++i) {
-    min_lengths[i] = LCP[i] + 1;
+    min_lengths[i] = lcp(i) + 1;
     if (i) {
       min_lengths[i - 1] = max(min_lengths[i - 1], min_lengths[i]);
       if (i % notify == 0) {
@@ -667,9 +1577,9 @@ void longSA::show(Out & output, const bool bin ) const {
       if (min_lengths[rcsapos] >= i) min_lengths[rcsapos] = 0;
       if (show_all)
         cerr << "# " << pos << "\t" << name << "\t" << i + 1 << "\t"
-             << ref[pos] << "\t" << SA[pos] << "\t" << ISA[pos] << "\t"
-             << LCP[sapos] << "\t"
-             << (sapos + 1 < ref.N ? LCP[sapos+1] : 0UL) << "\t"
+             << ref[pos] << "\t" << sa(pos) << "\t" << ISA[pos] << "\t"
+             << lcp(sapos) << "\t"
+             << (sapos + 1 < ref.N ? lcp(sapos+1) : 0UL) << "\t"
              << min_lengths[rcsapos] << "\t"
              << min_lengths[sapos] << endl;
       if (bin) {
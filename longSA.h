@@ -11,6 +11,7 @@
 
 #include "./size.h"
 #include "./fasta.h"
+#include "./rindex.h"
 
 // Stores the LCP array in an unsigned char (0-255).  Values larger
 // than or equal to 255 are stored in a sorted array.
@@ -43,9 +44,20 @@ struct vec_uchar {
   // Once all the values are set, call init. This will assure the
   // values >= 255 are sorted by index for fast retrieval.
   void init();
-  void load(const std::string & base, FILE * index);
-  void save(const std::string & base, FILE * index) const;
+  void load(const std::string & base, FILE * index,
+            const std::string & name = "lcp");
+  void save(const std::string & base, FILE * index,
+            const std::string & name = "lcp") const;
+  // Like load, but with values from a compressed file made by
+  // save_compressed, decompressed by n_threads.
+  void load_compressed(const std::string & base, FILE * index,
+                       const unsigned int n_threads);
+  void save_compressed(const std::string & base) const;
   void resize(const size_t N);
+  const unsigned char * data() const { return vec; }
+  uint64_t bytes() const { return N_vec; }
+  const item_t * overflow() const { return M; }
+  uint64_t overflow_bytes() const { return N_M * sizeof(item_t); }
 
  private:
   uint64_t N_vec;
@@ -60,6 +72,203 @@ struct vec_uchar {
   vec_uchar & operator=(const vec_uchar & disabled_assignment_operator);
 };
 
+// Suffix array and LCP array interleaved in cache line sized blocks,
+// so that SA[i] and LCP[i] and their neighbors share a cache line.
+// As in vec_uchar, LCP values >= 255 are kept in a sorted array.
+struct sa_lcp_blocks {
+  static const uint64_t block_entries = 64 / (sizeof(ANINT) + 1);
+  struct block_t {
+    ANINT sa[block_entries];
+    unsigned char lcp[block_entries];
+  } __attribute__((aligned(64)));
+  typedef vec_uchar::item_t item_t;
+
+  sa_lcp_blocks() : N(0), n_blocks(0), blocks(nullptr), N_M(0), M(nullptr),
+                    using_mapping(false) {}
+  ~sa_lcp_blocks();
+
+  ANINT sa(const uint64_t idx) const {
+    return blocks[idx / block_entries].sa[idx % block_entries];
+  }
+  ANINT lcp(const uint64_t idx) const {
+    const unsigned char v =
+        blocks[idx / block_entries].lcp[idx % block_entries];
+    if (v == std::numeric_limits<unsigned char>::max())
+      return std::lower_bound(M, M + N_M, item_t(idx, 0))->val;
+    else
+      return v;
+  }
+  bool empty() const { return N == 0; }
+  const block_t * data() const { return blocks; }
+  uint64_t bytes() const { return n_blocks * sizeof(block_t); }
+  const item_t * overflow() const { return M; }
+  uint64_t overflow_bytes() const { return N_M * sizeof(item_t); }
+
+  // Copy from the separate arrays.
+  void build(const ANINT * SA, const vec_uchar & LCP, const uint64_t N_);
+  void load(const std::string & base, FILE * index);
+  void save(const std::string & base, FILE * index) const;
+
+ private:
+  uint64_t N;
+  uint64_t n_blocks;
+  block_t * blocks;
+  uint64_t N_M;
+  item_t * M;
+  bool using_mapping;
+  sa_lcp_blocks(const sa_lcp_blocks & disabled_copy_constructor);
+  sa_lcp_blocks & operator=(const sa_lcp_blocks & disabled_assignment_operator);
+};
+
+// Hash table of the reference k-mers (k <= 32) that occur exactly
+// once in the reference.  K-mers are packed 2 bits per base, so only
+// k-mers made of a, c, g and t are stored.  Open addressing with
+// linear probing, keys and positions kept in separate arrays.
+struct unique_kmers {
+  unique_kmers() : k(0), shift(64), capacity(0), n_kmers(0), keys(nullptr),
+                   positions(nullptr), using_mapping(false) {}
+  ~unique_kmers();
+
+  static const ANINT empty_slot = std::numeric_limits<ANINT>::max();
+
+  // Pack k bases of s into code, false if a non-acgt base is seen.
+  bool encode(const char * s, uint64_t & code) const {
+    code = 0;
+    for (unsigned int i = 0; i != k; ++i) {
+      switch (s[i]) {
+        case 'a': code <<= 2; break;
+        case 'c': code = (code << 2) | 1; break;
+        case 'g': code = (code << 2) | 2; break;
+        case 't': code = (code << 2) | 3; break;
+        default: return false;
+      }
+    }
+    return true;
+  }
+  // Reference position of the unique k-mer starting at s, or empty_slot.
+  ANINT find(const char * s) const {
+    uint64_t code;
+    if (!encode(s, code)) return empty_slot;
+    for (uint64_t slot = hash(code); positions[slot] != empty_slot;
+         slot = (slot + 1) & (capacity - 1))
+      if (keys[slot] == code) return positions[slot];
+    return empty_slot;
+  }
+  bool empty() const { return n_kmers == 0; }
+  unsigned int kmer_length() const { return k; }
+  uint64_t size() const { return n_kmers; }
+  const uint64_t * key_data() const { return keys; }
+  const ANINT * position_data() const { return positions; }
+  uint64_t key_bytes() const { return capacity * sizeof(uint64_t); }
+  uint64_t position_bytes() const { return capacity * sizeof(ANINT); }
+
+  // Allocate an empty table for n k-mers of length k_, then insert them.
+  void resize(const unsigned int k_, const uint64_t n);
+  void insert(const uint64_t code, const ANINT pos);
+  void load(const std::string & base);
+  void save(const std::string & base) const;
+
+ private:
+  uint64_t hash(const uint64_t code) const {
+    return (code * 0x9E3779B97F4A7C15ULL) >> shift;
+  }
+  unsigned int k;
+  unsigned int shift;
+  uint64_t capacity;
+  uint64_t n_kmers;
+  uint64_t * keys;
+  ANINT * positions;
+  bool using_mapping;
+  unique_kmers(const unique_kmers & disabled_copy_constructor);
+  unique_kmers & operator=(const unique_kmers & disabled_assignment_operator);
+};
+
+// The first key_length characters of every step-th suffix, packed in
+// big endian words so that they compare like the suffixes, stored in
+// Eytzinger (breadth first) order so that the top of a binary search
+// over them stays in cache.  Narrows a search from the suffix array
+// root down to the suffixes between two samples.
+struct top_tree {
+  static const uint64_t key_length = 16;
+  static const uint64_t default_step = 4096;
+  struct node_t {
+    bool operator<(const node_t & rhs) const {
+      return key[0] < rhs.key[0] ||
+          (key[0] == rhs.key[0] && key[1] < rhs.key[1]);
+    }
+    uint64_t key[2];
+  };
+
+  top_tree() : N(0), step(0), n(0), nodes(nullptr), ranks(nullptr),
+               using_mapping(false) {}
+  ~top_tree();
+
+  // Key of the first key_length of length characters of s, padded with 0.
+  static node_t make_key(const char * s, const uint64_t length) {
+    node_t node;
+    for (unsigned int w = 0; w != 2; ++w) {
+      node.key[w] = 0;
+      for (unsigned int i = 0; i != key_length / 2; ++i) {
+        const uint64_t j = w * key_length / 2 + i;
+        node.key[w] = (node.key[w] << 8) |
+            (j < length ? static_cast<unsigned char>(s[j]) : 0);
+      }
+    }
+    return node;
+  }
+
+  // Narrow [start, end] to a range holding every suffix that starts
+  // with the first key_length characters of X.  False if X is shorter.
+  bool narrow(const char * X, const uint64_t length,
+              uint64_t & start, uint64_t & end) const {
+    if (length < key_length) return false;
+    const node_t key = make_key(X, length);
+    const uint64_t first_not_less = bound(key, false);
+    const uint64_t first_greater = bound(key, true);
+    start = first_not_less ? (first_not_less - 1) * step + 1 : 0;
+    end = first_greater != n ? first_greater * step - 1 : N - 1;
+    return start <= end;
+  }
+
+  bool empty() const { return n == 0; }
+  uint64_t sample_step() const { return step; }
+  uint64_t size() const { return n; }
+  const node_t * node_data() const { return nodes; }
+  const ANINT * rank_data() const { return ranks; }
+  uint64_t node_bytes() const { return n ? (n + 1) * sizeof(node_t) : 0; }
+  uint64_t rank_bytes() const { return n ? (n + 1) * sizeof(ANINT) : 0; }
+
+  // Build from keys of SA[0], SA[step], SA[2 * step]... in order.
+  void build(const std::vector<node_t> & sorted, const uint64_t step_,
+             const uint64_t N_);
+  void load(const std::string & base, FILE * index);
+  void save(const std::string & base, FILE * index) const;
+
+ private:
+  // Sorted rank of the first sample not less than (or greater than) key,
+  // or n if there is none.
+  uint64_t bound(const node_t & key, const bool greater) const {
+    uint64_t k = 1;
+    while (k <= n) {
+      __builtin_prefetch(nodes + 16 * k);
+      k = 2 * k + (greater ? !(key < nodes[k]) : nodes[k] < key);
+    }
+    k >>= __builtin_ffsll(~k);
+    return k ? ranks[k] : n;
+  }
+  uint64_t fill(const std::vector<node_t> & sorted, uint64_t i,
+                const uint64_t k);
+
+  uint64_t N;
+  uint64_t step;
+  uint64_t n;
+  node_t * nodes;  // 1 based, node k has children 2k and 2k + 1
+  ANINT * ranks;  // sorted rank of node k
+  bool using_mapping;
+  top_tree(const top_tree & disabled_copy_constructor);
+  top_tree & operator=(const top_tree & disabled_assignment_operator);
+};
+
 // depth : [start...end]
 struct interval_t {
   interval_t() : depth(-1), start(1), end(0) { }
@@ -94,10 +303,23 @@ struct match_t {
 class Args;
 class SAArgs {
  public:
-  SAArgs() : verbose(false), mappability(false), ref_args() {}
+  SAArgs() : verbose(false), mappability(false), lcplr(false), rindex(false),
+             interleaved(false), toptree(false), compressed(false),
+             unique_k(0), seed_stride(1), mask_length(0), warm_threads(0),
+             lock_index(false), ref_args() {}
   operator const RefArgs & () const { return ref_args; }
   bool verbose;
   bool mappability;
+  bool lcplr;  // use LCP-LR arrays for searches from the root
+  bool rindex;  // use run-length BWT in place of SA/ISA/LCP
+  bool interleaved;  // use interleaved SA/LCP blocks in place of SA and LCP
+  bool toptree;  // use a sampled top tree for searches from the root
+  bool compressed;  // load SA, ISA and LCP from compressed files
+  unsigned int unique_k;  // k-mer length of unique k-mer index, 0 for none
+  unsigned int seed_stride;  // query offsets between fresh MAM searches
+  unsigned int mask_length;  // omit suffixes less mappable, 0 for none
+  unsigned int warm_threads;  // threads to fault in the index, 0 for none
+  bool lock_index;  // mlock the index in memory
  private:
   RefArgs ref_args;
   SAArgs & operator=(const SAArgs & disabled_assignment_operator);
@@ -114,13 +336,36 @@ struct longSA : public SAArgs {
   const uint64_t N;  // !< Length of the sequence.
 
   const uint64_t logN;  // ceil(log(N))
-  const uint64_t Nm1;  // N - 1
+  uint64_t n_sa;  // number of suffixes in SA, less than N if masked
+  uint64_t Nm1;  // n_sa - 1
 
   //  std::vector<ANINT> SA;  // Suffix array.
   //  std::vector<ANINT> ISA;  // Inverse suffix array.
   ANINT * SA;
   ANINT * ISA;
   vec_uchar LCP;  // Simulates a vector<int> LCP.
+  // With -mask, the minimum unique length at the start of each suffix
+  unsigned char * min_unique;
+  unique_kmers unique;  // Optional index of k-mers unique in reference.
+  // Optional Manber-Myers LCP-LR arrays. For the binary search
+  // interval (l, r) with midpoint m, LLCP[m] = lcp(SA[l], SA[m])
+  // and RLCP[m] = lcp(SA[m], SA[r]).
+  vec_uchar LLCP;
+  vec_uchar RLCP;
+  // Optional run-length BWT.  When loaded, SA, ISA and LCP are not.
+  RIndex BWT;
+  // Optional interleaved SA and LCP.  When loaded, SA and LCP are not.
+  sa_lcp_blocks SALCP;
+  // Optional sampled suffixes to start searches from the root.
+  top_tree top;
+
+  // SA[i] and LCP[i] from whichever layout is loaded
+  ANINT sa(const uint64_t i) const {
+    return interleaved ? SALCP.sa(i) : SA[i];
+  }
+  ANINT lcp(const uint64_t i) const {
+    return interleaved ? SALCP.lcp(i) : LCP[i];
+  }
 
   // Constructor builds suffix array.
   explicit longSA(const SAArgs & arguments);
@@ -129,6 +374,29 @@ struct longSA : public SAArgs {
   // Modified Kasai et all for LCP computation.
   void computeLCP();
 
+  // Find k-mers unique in the reference using SA/ISA/LCP.
+  void computeUnique();
+
+  // Copy from the saved full index at full_base the suffixes starting
+  // where the minimum unique length in the mappability file is at most
+  // mask_length.  ISA of other positions is n_sa.
+  void computeMasked(const std::string & full_base,
+                     const uint64_t fasta_size, const std::string & map_file);
+
+  // With -mask, a match shorter than the minimum unique length at its
+  // start (SA index rank) is repeated in the full reference
+  bool masked_repeat(const uint64_t rank, const uint64_t len) const {
+    return min_unique && (rank == n_sa || len < min_unique[rank]);
+  }
+
+  // Write SA, ISA and LCP.
+  void save_index(const std::string & bin_base,
+                  const std::string & saved_index,
+                  const uint64_t fasta_size) const;
+
+  // Fill LLCP/RLCP for the search interval (l, r), returning lcp(l, r).
+  uint64_t computeLCPLR(const uint64_t l, const uint64_t r);
+
   // Binary search for left boundry of interval.
   inline uint64_t bsearch_left(const char c, const uint64_t i,
                                     uint64_t l, uint64_t r) const;
@@ -140,34 +408,80 @@ struct longSA : public SAArgs {
   inline bool search(const std::string &P, uint64_t &start,
                      uint64_t &end) const;
 
+  // Compare pattern X of length n to suffix SA[i], given that the
+  // first h characters are known to match.  Updates h to the lcp and
+  // returns 0 if X is a prefix of the suffix, else the sign of X - suffix.
+  inline int compare(const char * X, const uint64_t n, const uint64_t i,
+                     uint64_t & h) const;
+
+  // LCP-LR binary search: first SA index whose suffix is not less
+  // than X (right false) or greater than X (right true), with lcp of
+  // X to the suffixes just before and at that index.
+  inline uint64_t lcplr_bound(const char * X, const uint64_t n,
+                              const bool right, uint64_t & lcp_before,
+                              uint64_t & lcp_at) const;
+
+  // Match from the root to the first mismatch using LCP-LR searches.
+  inline void root_search(const std::string &P, const uint64_t prefix,
+                          interval_t &cur, uint64_t & work) const;
+
+  // Fill top from every step-th suffix.
+  void computeTopTree(const uint64_t step);
+
+  // Time searches from the root with and without the top tree.
+  void benchmark_top_tree() const;
+
+  // Report index residency, optionally fault in and lock the index.
+  void warm_up() const;
+
+  // Match from the root to the first mismatch, starting from the
+  // range given by the top tree.  Leaves cur unchanged on failure.
+  inline void top_search(const std::string &P, const uint64_t prefix,
+                         interval_t &cur, uint64_t & work) const;
+
   // Simple top down traversal of a suffix array.
   inline bool top_down(const char c, const uint64_t i,
                        uint64_t &start, uint64_t &end) const;
   inline bool top_down_faster(const char c, const uint64_t i,
-                              uint64_t &start, uint64_t &end) const;
+                              uint64_t &start, uint64_t &end,
+                              uint64_t & work) const;
 
   // Traverse pattern P starting from a given prefix and interval
-  // until mismatch or min_len characters reached.
+  // until mismatch or min_len characters reached.  Suffix array
+  // probes are added to work.
   inline void traverse(const std::string &P, const uint64_t prefix,
-                       interval_t &cur, const ANINT min_len) const;
+                       interval_t &cur, const ANINT min_len,
+                       uint64_t & work) const;
+
+  // Start a traversal at the root from a unique k-mer, if present.
+  inline void seed(const std::string &P, const uint64_t prefix,
+                   interval_t &cur) const;
 
   // Simulate a suffix link.
-  inline bool suffixlink(interval_t * m) const;
+  inline bool suffixlink(interval_t * m, uint64_t & work) const;
 
   // Expand ISA/LCP interval. Used to simulate suffix links.
-  inline bool expand_link(interval_t * link) const {
+  // Expansion steps are added to work.
+  inline bool expand_link(interval_t * link, uint64_t & work) const {
     const uint64_t thresh = 2 * link->depth * logN;
     uint64_t exp = 0;  // Threshold link expansion.
     uint64_t start = link->start;
     uint64_t end = link->end;
-    while (LCP[start] >= link->depth) {
-      if (++exp >= thresh) return false;
+    while (lcp(start) >= link->depth) {
+      if (++exp >= thresh) {
+        work += exp;
+        return false;
+      }
       --start;
     }
-    while (end < Nm1 && LCP[end+1] >= link->depth) {
-      if (++exp >= thresh) return false;
+    while (end < Nm1 && lcp(end+1) >= link->depth) {
+      if (++exp >= thresh) {
+        work += exp;
+        return false;
+      }
       ++end;
     }
+    work += exp;
     link->start = start;
     link->end = end;
     return true;
@@ -193,9 +507,17 @@ struct longSA : public SAArgs {
   // pattern P.
   // NOTE: min_len must be > 1
   void MAM(Aligner & query) const;
+
+  // MAM searching from the root only at every seed_stride-th query
+  // offset, recovering left maximality by extension against ref.
+  void strided_MAM(Aligner & query) const;
   inline bool is_leftmaximal(const std::string &P, const uint64_t p1,
                              const uint64_t p2) const;
 
+  // MAM shortcut for a query that matches the reference end to end
+  // around a unique k-mer.  Returns false if MAM must be run instead.
+  bool unique_MAM(Aligner & query) const;
+
   // Find Maximal Exact Matches (MEMs)
   void MEM(Aligner & query) const;
 
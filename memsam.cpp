@@ -1,5 +1,8 @@
 // Copyright 2014 Peter Andrews CSHL
 
+#include <string.h>
+
+#include <algorithm>
 #include <map>
 #include <string>
 
@@ -7,3 +10,35 @@
 
 
 std::map <std::string, uint64_t> MemSam::chromosomes{};
+
+SamKey::SamKey(const char * in, std::string & chromosome)
+    : position(0), name_prefix(0), data(in) {
+  const char * field = in;
+  for (unsigned int c = 0; c != 8; ++c) {
+    name_prefix <<= 8;
+    if (*field != '\t') name_prefix |= static_cast<unsigned char>(*field++);
+  }
+  const char * const chromosome_start = next_field(next_field(field));
+  const char * const position_start = next_field(chromosome_start);
+  chromosome.assign(chromosome_start, position_start - 1);
+  position = atol(position_start) + MemSam::chromosomes.at(chromosome);
+}
+
+bool SamKey::tie_break(const SamKey & right) const {
+  const char * const name_end = next_field(data) - 1;
+  const char * const right_name_end = next_field(right.data) - 1;
+  const uint64_t length = name_end - data;
+  const uint64_t right_length = right_name_end - right.data;
+  const int order = memcmp(data, right.data, std::min(length, right_length));
+  if (order) return order < 0;
+  if (length != right_length) return length < right_length;
+  const unsigned int mate_bits = is_first | is_second | is_reversed;
+  const unsigned int mate_info = atoi(name_end + 1) & mate_bits;
+  const unsigned int r_mate_info = atoi(right_name_end + 1) & mate_bits;
+  if (mate_info == r_mate_info) {
+    const std::string left_line(data, next_read(data) - 1);
+    const std::string right_line(right.data, next_read(right.data) - 1);
+    throw paa::Error("flags equal") << "\n" << left_line << "\n" << right_line;
+  }
+  return mate_info < r_mate_info;
+}
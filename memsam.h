@@ -181,6 +181,32 @@ class MemSam {
   uint64_t absolute_position_;
 };
 
+// Sort key of a SAM line, computed once when the line is finished.
+// Orders lines as MemSam::operator< does, but only lines with the same
+// absolute position and first eight name characters are parsed again.
+class SamKey {
+ public:
+  SamKey() : position(0), name_prefix(0), data(nullptr) {}
+  // chromosome is a buffer for the lookup, to avoid an allocation
+  SamKey(const char * in, std::string & chromosome);
+  bool operator<(const SamKey & right) const {
+    if (position != right.position) return position < right.position;
+    if (name_prefix != right.name_prefix)
+      return name_prefix < right.name_prefix;
+    return tie_break(right);
+  }
+  bool same_prefix(const SamKey & right) const {
+    return position == right.position && name_prefix == right.name_prefix;
+  }
+
+  uint64_t position;  // absolute position
+  uint64_t name_prefix;  // first eight name characters, big endian
+  const char * data;
+
+ private:
+  bool tie_break(const SamKey & right) const;
+};
+
 template <class Out>
 Out & operator<<(Out & out, const MemSam & sam) {
   sam.out(out);
@@ -0,0 +1,263 @@
+//
+// merge_mapout
+//
+// Merges the sorted SAM or BAM parts that mummer -samout or -bamout
+// writes to mapout/ into one stream in the same order, as SAM on stdout
+// or as BAM
+//
+// Copyright 2015 Peter Andrews @ CSHL
+//
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./bam.h"
+#include "./error.h"
+#include "./memsam.h"
+#include "./util.h"
+
+using std::cerr;
+using std::endl;
+using std::exception;
+using std::istringstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+using paa::Error;
+
+namespace {
+
+// One sorted part, positioned at its current line.  Parts are SAM text
+// (.txt) or BAM (.bam), which is decoded back to SAM lines.
+class Part {
+ public:
+  explicit Part(const string & file_name) : done(false) {
+    if (file_name.size() > 4 &&
+        file_name.compare(file_name.size() - 4, 4, ".bam") == 0)
+      bam.reset(new BamReader(file_name));
+    else
+      text.reset(new LineReader(file_name));
+  }
+  // Reads the header and keeps the first line
+  void start() {
+    if (bam) {
+      header = bam->header();
+      done = !bam->next(line);
+      return;
+    }
+    const char * data;
+    uint64_t length;
+    bool more;
+    while ((more = text->next(data, length)) && length && *data == '@') {
+      header.append(data, length);
+      header += '\n';
+    }
+    if (more && length) {
+      set(data, length);
+    } else {
+      done = true;
+    }
+  }
+  void set_key(string & chromosome) {
+    if (!done) key = SamKey(line.c_str(), chromosome);
+  }
+  void advance(string & chromosome) {
+    if (bam) {
+      done = !bam->next(line);
+      set_key(chromosome);
+      return;
+    }
+    const char * data;
+    uint64_t length;
+    if (text->next(data, length) && length) {
+      set(data, length);
+      set_key(chromosome);
+    } else {
+      done = true;
+    }
+  }
+  bool operator<(const Part & right) const {
+    if (done) return false;
+    if (right.done) return true;
+    return key < right.key;
+  }
+
+  string header;
+  string line;  // with its newline
+  SamKey key;
+  bool done;
+
+ private:
+  void set(const char * data, const uint64_t length) {
+    line.assign(data, length);
+    line += '\n';
+  }
+  unique_ptr<LineReader> text;
+  unique_ptr<BamReader> bam;
+};
+
+// Tournament tree over k parts: each internal node keeps the loser of
+// the match played there and node 0 the winner, so after the winner
+// advances only the matches on its path to the root are replayed
+class LoserTree {
+ public:
+  explicit LoserTree(const vector<unique_ptr<Part> > & parts_)
+      : parts(parts_), k(parts.size()), tree(std::max<uint64_t>(k, 1)) {
+    if (k) tree[0] = build(1);
+  }
+  uint64_t winner() const { return tree[0]; }
+  void replay() {
+    uint64_t winner = tree[0];
+    for (uint64_t node = (winner + k) / 2; node; node /= 2)
+      if (less(tree[node], winner)) std::swap(tree[node], winner);
+    tree[0] = winner;
+  }
+
+ private:
+  bool less(const uint64_t left, const uint64_t right) const {
+    return *parts[left] < *parts[right];
+  }
+  uint64_t build(const uint64_t node) {
+    if (node >= k) return node - k;
+    const uint64_t left = build(2 * node);
+    const uint64_t right = build(2 * node + 1);
+    if (less(right, left)) {
+      tree[node] = left;
+      return right;
+    } else {
+      tree[node] = right;
+      return left;
+    }
+  }
+  const vector<unique_ptr<Part> > & parts;
+  const uint64_t k;
+  vector<uint64_t> tree;
+};
+
+// SAM text and BAM parts in a directory, in name order
+void add_directory(const string & dir_name, vector<string> & names) {
+  DIR * dir = opendir(dir_name.c_str());
+  if (dir == nullptr) throw Error("could not open directory") << dir_name;
+  vector<string> found;
+  while (const dirent * entry = readdir(dir)) {
+    const string name = entry->d_name;
+    if (name.size() > 4 && (name.compare(name.size() - 4, 4, ".txt") == 0 ||
+                            name.compare(name.size() - 4, 4, ".bam") == 0))
+      found.push_back(dir_name + "/" + name);
+  }
+  closedir(dir);
+  sort(found.begin(), found.end());
+  names.insert(names.end(), found.begin(), found.end());
+}
+
+// Chromosome offsets for SamKey, as mummer sets them from the reference
+void set_chromosomes(const string & header) {
+  istringstream lines(header);
+  string line;
+  uint64_t offset = 0;
+  while (getline(lines, line)) {
+    if (line.compare(0, 4, "@SQ\t")) continue;
+    const uint64_t name_start = line.find("\tSN:");
+    const uint64_t length_start = line.find("\tLN:");
+    if (name_start == string::npos || length_start == string::npos)
+      throw Error("@SQ header line needs SN and LN") << line;
+    const uint64_t name_end = line.find('\t', name_start + 4);
+    MemSam::chromosomes[line.substr(name_start + 4, name_end == string::npos ?
+                                    string::npos : name_end - name_start - 4)]
+        = offset;
+    offset += atol(line.c_str() + length_start + 4);
+  }
+  MemSam::chromosomes["*"] = offset;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) try {
+  --argc;
+  ++argv;
+  string bam_name;
+  if (argc >= 2 && string(argv[0]) == "-bam") {
+    bam_name = argv[1];
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc < 1)
+    throw Error("usage: merge_mapout [-bam out.bam] mapout_dir_or_part ...");
+
+  vector<string> names;
+  for (int a = 0; a != argc; ++a) {
+    struct stat status;
+    if (stat(argv[a], &status) == 0 && S_ISDIR(status.st_mode))
+      add_directory(argv[a], names);
+    else
+      names.push_back(argv[a]);
+  }
+  if (names.empty()) throw Error("no mapout parts to merge");
+
+  // All parts come from one run, so share a header
+  vector<unique_ptr<Part> > parts;
+  for (const string & name : names) {
+    parts.emplace_back(new Part(name));
+    parts.back()->start();
+    if (parts.back()->header != parts.front()->header)
+      throw Error("mapout part has a different header") << name;
+  }
+  const string header = parts.front()->header;
+  set_chromosomes(header);
+  string chromosome;
+  for (unique_ptr<Part> & part : parts) part->set_key(chromosome);
+
+  unique_ptr<BamWriter> bam;
+  if (bam_name.size()) {
+    bam.reset(new BamWriter(bam_name, header));
+  } else {
+    setvbuf(stdout, nullptr, _IOFBF, 4 << 20);
+    fputs(header.c_str(), stdout);
+  }
+  LoserTree tree(parts);
+  uint64_t n_lines = 0;
+  while (true) {
+    Part & part = *parts[tree.winner()];
+    if (part.done) break;
+    if (bam) {
+      bam->add(part.line.c_str());
+    } else if (fwrite(part.line.data(), 1, part.line.size(), stdout) !=
+               part.line.size()) {
+      throw Error("problem writing merged output");
+    }
+    ++n_lines;
+    part.advance(chromosome);
+    tree.replay();
+  }
+  if (bam) bam->close();
+  if (fflush(stdout)) throw Error("problem writing merged output");
+  cerr << "merged " << n_lines << " lines from " << parts.size()
+       << " parts" << endl;
+
+  return 0;
+} catch (Error & e) {
+  cerr << "paa::Error:" << endl;
+  cerr << e.what() << endl;
+  return 1;
+}
+catch (exception & e) {
+  cerr << "std::exception" << endl;
+  cerr << e.what() << endl;
+  return 1;
+}
+catch (...) {
+  cerr << "unknown exception was caught" << endl;
+  return 1;
+}
@@ -92,6 +92,22 @@ Args::Args(int argc_, char * argv_[], char * envp_[])
     {"cached", 0, nullptr, 0},  // 14
     {"normalmem", 0, nullptr, 0},  // 15
     {"minblock", 1, nullptr, 0},  // 16
+    {"unique", 1, nullptr, 0},  // 17
+    {"lcplr", 0, nullptr, 0},  // 18
+    {"rindex", 0, nullptr, 0},  // 19
+    {"interleaved", 0, nullptr, 0},  // 20
+    {"toptree", 0, nullptr, 0},  // 21
+    {"seedstride", 1, nullptr, 0},  // 22
+    {"budget", 1, nullptr, 0},  // 23
+    {"compressed", 0, nullptr, 0},  // 24
+    {"directio", 0, nullptr, 0},  // 25
+    {"loadthreads", 1, nullptr, 0},  // 26
+    {"warmup", 1, nullptr, 0},  // 27
+    {"mlock", 0, nullptr, 0},  // 28
+    {"mask", 1, nullptr, 0},  // 29
+    {"fq1", 1, nullptr, 0},  // 30
+    {"fq2", 1, nullptr, 0},  // 31
+    {"bamout", 0, nullptr, 0},  // 32
     {nullptr, 0, nullptr, 0}
   };
   while (1) {
@@ -129,6 +145,22 @@ Args::Args(int argc_, char * argv_[], char * envp_[])
         case 14: read_ahead = false; break;
         case 15: memory_mapped = false; break;
         case 16: min_block = atoi(optarg); break;
+        case 17: unique_k = atoi(optarg); break;
+        case 18: lcplr = true; break;
+        case 19: rindex = true; break;
+        case 20: interleaved = true; break;
+        case 21: toptree = true; break;
+        case 22: seed_stride = atoi(optarg); break;
+        case 23: max_work = atol(optarg); break;
+        case 24: compressed = true; break;
+        case 25: direct_io = true; break;
+        case 26: load_threads = atoi(optarg); break;
+        case 27: warm_threads = atoi(optarg); break;
+        case 28: lock_index = true; break;
+        case 29: mask_length = atoi(optarg); break;
+        case 30: fastq1 = optarg; break;
+        case 31: fastq2 = optarg; break;
+        case 32: sam_out = bam_out = true; break;
         default: break;
       }
     }
@@ -136,14 +168,34 @@ Args::Args(int argc_, char * argv_[], char * envp_[])
 
   // Validate arguments
   argc -= optind;
-  if (argc < 2) {
+  if (argc < (fastq1 ? 1 : 2)) {
     cerr << "There are too few arguments" << endl;
     usage(argv[0]);
   }
   if (fastq && sam_in) throw Error("-fastq cannot be used with -samin");
+  if (!fastq1 != !fastq2) throw Error("-fq1 and -fq2 must be used together");
   if (nomap && !sam_out) throw Error("-nomap can only be used with -sam_out");
   if (mappability && !ref_args.rcref)
     throw Error("-mappability requires -rcref");
+  if (unique_k > 32) throw Error("-unique k-mer length must be 32 or less");
+  if (rindex && (type == MEM || mappability || lcplr || unique_k ||
+                 interleaved || toptree))
+    throw Error("-rindex cannot be used with -maxmatch, -mappability, "
+                "-lcplr, -unique, -interleaved or -toptree");
+  if (direct_io && memory_mapped)
+    throw Error("-directio requires -normalmem");
+  if (load_threads < 1) throw Error("-loadthreads must be at least 1");
+  if (mask_length > 254)
+    throw Error("-mask length must be 254 or less");
+  if (mask_length && !ref_args.rcref) throw Error("-mask requires -rcref");
+  if (mask_length && (type != MAM || mappability || rindex || unique_k ||
+                      interleaved || compressed))
+    throw Error("-mask cannot be used with -maxmatch, -mum, -mappability, "
+                "-rindex, -unique, -interleaved or -compressed");
+  if (seed_stride < 1 || seed_stride > min_len)
+    throw Error("-seedstride must be from 1 to the minimum match length");
+  if (seed_stride > 1 && (type == MEM || rindex))
+    throw Error("-seedstride cannot be used with -maxmatch or -rindex");
   char * * args = argv + optind;
   ref_args.ref_fasta = *args;
   n_input = argc - 1;
@@ -185,7 +237,8 @@ void Args::check_integer_sizes() const {
 // Display proper command line usage
 void Args::usage(const string & prog) const {
   cerr << "Usage: " << prog <<
-      " [options] <reference-file> <query-file> ...\n"
+      " [options] <reference-file> [<query-file> ...]\n"
+      "Query files may be gzip or BGZF compressed\n"
       "Implemented MUMmer v3 options:\n"
       "-mum         "
       "  compute maximal matches that are unique in both sequences\n"
@@ -204,16 +257,53 @@ void Args::usage(const string & prog) const {
       "-verbose       output diagnostics and progress to stderr\n"
       "-samin         input in SAM format\n"
       "-samout        output in basic SAM format\n"
+      "-bamout        output BGZF compressed BAM files in place of SAM\n"
+      "               text - records are encoded directly from the\n"
+      "               alignments, and blocks are compressed by one\n"
+      "               shared pool of a thread per core\n"
       "-qthreads      number of threads to use for queries\n"
       "-nomap         output unmapped reads too (only when -samout)\n"
       "-rcref         reverse complement reference\n"
       "-fastq         fastq input\n"
+      "-fq1, -fq2     paired fastq (or fasta) files read in lockstep as\n"
+      "               mates, instead of or in addition to query files\n"
       "-mappability   output mappability measures only\n"
       "-minblock      with -samout, after merge of mapped segments\n"
       "               by read-start position, ensures that a mapped block\n"
       "               is of a minimum length\n"
+      "-unique        k-mer length (up to 32) of an index of reference\n"
+      "               k-mers that occur once, used to speed up MAM search\n"
+      "-lcplr         build and use LCP-LR arrays for faster searches\n"
+      "               from the suffix array root\n"
+      "-rindex        use a run-length BWT index in place of the suffix\n"
+      "               array, for highly repetitive references\n"
+      "-interleaved   use suffix array and LCP values interleaved in cache\n"
+      "               line blocks (see interleave_index)\n"
+      "-toptree       build and use a small cache resident sample of the\n"
+      "               suffix array for searches from the root\n"
+      "-seedstride    search for MAMs only from every S-th query position\n"
+      "               (1 to minimum match length, default 1) - faster but\n"
+      "               can miss MAMs shorter than minimum length + S - 1\n"
+      "-budget        per read work limit in suffix array probes,\n"
+      "               suffix link steps and r-index extensions (default\n"
+      "               0, no limit) - reads that run out are output with\n"
+      "               matches found so far and tag XB:i:work\n"
+      "-compressed    load the suffix array, ISA and LCP from compressed\n"
+      "               files (made on first use) with all cores\n"
+      "-mask          build and use an index without the suffixes that\n"
+      "               start where the minimum unique length (from\n"
+      "               reference.bin/map.bin) is over this length (up to\n"
+      "               254) - MAMs of reads no longer than this are\n"
+      "               unchanged\n"
+      "-warmup        number of threads used to fault in the index\n"
+      "               before queries start (default 0, none)\n"
+      "-mlock         lock the index in memory so that other jobs\n"
+      "               cannot evict it\n"
       "-cached        shorter real time for subsequent runs only\n"
-      "-normalmem    turn off memory mapping" << endl;
+      "-normalmem    turn off memory mapping\n"
+      "-loadthreads   with -normalmem, number of parallel reads used to\n"
+      "               load the reference and index (default 16)\n"
+      "-directio      with -normalmem, load bypassing the page cache" << endl;
   exit(1);
 }
 
@@ -3,6 +3,7 @@
 #include "./query.h"
 
 #include <pthread.h>
+#include <string.h>
 
 #include <exception>
 using std::exception;
@@ -19,25 +20,40 @@ using std::swap;
 using std::istringstream;
 using std::ostringstream;
 
-#include <fstream>
-using std::ifstream;
-
 #include <iostream>
 using std::cout;
 using std::cerr;
 using std::endl;
 
+#include "./bam.h"
 #include "./util.h"
 #include "./error.h"
 using paa::Error;
 
+#ifdef COUNT_ALLOCATIONS
+// Build with make DEBUG=-DCOUNT_ALLOCATIONS to count heap allocations
+// in each thread, and check that mapping allocates nothing per read
+// once reused buffers have grown
+#include <new>
+thread_local uint64_t n_thread_allocations = 0;
+void * operator new(size_t size) {
+  ++n_thread_allocations;
+  void * const memory = malloc(size ? size : 1);
+  if (memory == nullptr) throw std::bad_alloc();
+  return memory;
+}
+void operator delete(void * memory) noexcept {
+  free(memory);
+}
+#endif
+
 #ifdef use_ctr
 
 // Alignment
 Alignment::Alignment()
     : rcpos(0), pos(0), qpos(0), seq_index(0), prefix(0), length(0), suffix(0),
       n_matches(0), n_unique_bases(0), n_matched_bases(0), alignment_index(0),
-      prev_alignment(0), next_alignment(0), best_mate(0), cigar("*"),
+      prev_alignment(0), next_alignment(0), best_mate(0), cigar(0),
       rc(false) { }
 #else
 void Alignment::partial_reset() {
@@ -58,9 +74,7 @@ void Alignment::reset() {
   prefix = 0;
   length = 0;
   suffix = 0;
-  cigar.resize(2);
-  cigar[0] = '*';
-  cigar[1] = 0;
+  cigar = 0;
   rc = false;
 }
 #endif
@@ -91,9 +105,7 @@ inline void Alignment::resolve(const match_t & input_match,
   }
   qpos = input_match.query;
   length = input_match.len;
-  cigar.resize(query_length * 5);
-  cigar[0] = '*';
-  cigar[1] = 0;
+  cigar = 0;
 }
 
 inline void Alignment::print(const Aligner &) { }
@@ -105,76 +117,93 @@ inline void Query::clear() {
   errors.clear();
   optional.clear();
 }
-inline void Query::swap(Query & other) {
-  name.swap(other.name);
-  original.swap(other.original);
-  query.swap(other.query);
-  errors.swap(other.errors);
-  optional.swap(other.optional);
+inline void Query::assign(const Query & other) {
+  name.assign(other.name);
+  original.assign(other.original);
+  query.assign(other.query);
+  errors.assign(other.errors);
+  optional.assign(other.optional);
 }
 
 // NewQuery
 NewQuery::NewQuery(const NewQueryArgs & args)
     : NewQueryArgs(args) {}
 
-inline void NewQuery::reset(string & name_) {
+inline void NewQuery::reset(const char * name_, const uint64_t length) {
   clear();
-  name.swap(name_);
+  name.assign(name_, length);
 }
 
-inline void NewQuery::extend(const string & line) {
-  uint64_t end = line.size();
-  while (end && line[end - 1] == ' ') --end;
-  for (uint64_t i = 0; i != end; ++i) {
-    if (line[i] == ' ') continue;
-    const char c = tolower(line[i]);
-    if (nucleotides_only) {
-      switch (c) {
+// Lowercase, and for nucleotides_only map all but acgt to ~
+static const class ExtendTables {
+ public:
+  ExtendTables() {
+    for (unsigned int c = 0; c != 256; ++c) {
+      lower[c] = nucleotide[c] = tolower(c);
+      switch (nucleotide[c]) {
         case 'a': case 't': case 'g': case 'c':
-          query.push_back(c);
           break;
         default:
-          query.push_back('~');
+          nucleotide[c] = '~';
       }
-    } else {
-      query.push_back(c);
     }
-    original.push_back(line[i]);
   }
-}
+  char lower[256];
+  char nucleotide[256];
+} extend_tables;
 
-inline void NewQuery::set_errors(string & line) {
-  if (line.empty()) throw Error("empty errors");
-  errors.swap(line);
+inline void NewQuery::extend(const char * line, uint64_t length) {
+  while (length && line[length - 1] == ' ') --length;
+  const char * const table = nucleotides_only ?
+      extend_tables.nucleotide : extend_tables.lower;
+  const uint64_t start = query.size();
+  query.resize(start + length);
+  original.resize(start + length);
+  uint64_t out = start;
+  for (uint64_t i = 0; i != length; ++i) {
+    const unsigned char c = line[i];
+    if (c == ' ') continue;
+    query[out] = table[c];
+    original[out++] = c;
+  }
+  query.resize(out);
+  original.resize(out);
 }
 
-inline void NewQuery::add_optional(string & opt) {
-  optional += "\t";
-  optional += opt;
+inline void NewQuery::set_errors(const char * line, const uint64_t length) {
+  if (!length) throw Error("empty errors");
+  errors.assign(line, length);
 }
 
-inline bool NewQuery::complete() const {
-  return query.size();
+inline void NewQuery::add_optional(const char * opt, const uint64_t length) {
+  optional += "\t";
+  optional.append(opt, length);
 }
 
 // Aligner
 Aligner::Aligner(const AlignerArgs & args, const longSA & sa_)
-    : Query(), AlignerArgs(args), sa(sa_), rcquery(""),
-      print(true), read_flag(0), best_alignment(nullptr), matches(0),
-      alignments(0), sorted_alignments(0), n_alignments(0) {}
+    : Query(), AlignerArgs(args), work(0), sa(sa_), rcquery(""),
+      print(true), partial_map(false), read_flag(0), best_alignment(nullptr),
+      matches(0), scratch(0),
+      alignments(0), sorted_alignments(0), n_alignments(0), cigars(2, '*') {
+  cigars[1] = '\0';
+}
 Aligner::Aligner(const Aligner & other)
-    : Query(other), AlignerArgs(other),
+    : Query(other), AlignerArgs(other), work(other.work),
       sa(other.sa), rcquery(other.rcquery),
-      print(other.print), read_flag(other.read_flag),
+      print(other.print), partial_map(other.partial_map),
+      read_flag(other.read_flag),
       best_alignment(other.best_alignment), matches(other.matches),
-      alignments(other.alignments),
+      scratch(other.scratch), alignments(other.alignments),
       sorted_alignments(other.sorted_alignments),
-      n_alignments(other.n_alignments) {}
+      n_alignments(other.n_alignments), cigars(other.cigars) {}
 
 inline void Aligner::clear() {
   Query::clear();
   rcquery.clear();
+  work = 0;
   print = true;
+  partial_map = false;
   read_flag = 0;
   best_alignment = nullptr;
   matches.clear();
@@ -182,10 +211,10 @@ inline void Aligner::clear() {
   sorted_alignments.clear();
   n_alignments = 0;
 }
-inline void Aligner::reset(NewQuery & new_query) {
+// Copied, not swapped, so each aligner keeps its own grown strings
+inline void Aligner::reset(const NewQuery & new_query) {
   clear();
-  Query::swap(new_query);
-  rcquery.swap(new_query.errors);
+  Query::assign(new_query);
   if (name.size() >= 2) {  // Look for :0 or :1 for mate info
     const uint64_t pos = name.size() - 2;
     if (name[pos] == ':') {
@@ -236,20 +265,26 @@ inline void Aligner::prepare_matches() {
     for (uint64_t i = 0; i != alignments.size(); ++i) {
       alignments[i].resolve(matches[i], query.size(), sa.ref);
     }
-    for (uint64_t i = alignments.size() - 1; ; --i) {
-      // Remove off-chromosome mappings with negative positions
-      if (alignments[i].pos < 0) {
-        matches.erase(matches.begin() + i);
-        alignments.erase(alignments.begin() + i);
+    // Remove off-chromosome mappings with negative positions
+    uint64_t n_kept = 0;
+    for (uint64_t i = 0; i != alignments.size(); ++i) {
+      if (alignments[i].pos >= 0) {
+        matches[n_kept] = matches[i];
+        alignments[n_kept++] = alignments[i];
       }
-      if (i == 0) break;
     }
+    matches.resize(n_kept);
+    alignments.resize(n_kept);
+    sorted_alignments.resize(n_kept);
     for (uint64_t i = 0; i != alignments.size(); ++i) {
-      sorted_alignments.push_back(&alignments[i]);
+      sorted_alignments[i] = &alignments[i];
     }
     if (matches.size() && sam_out) {
       sort(sorted_alignments.begin(), sorted_alignments.end(), to_merge());
-      uint64_t cigar_end = 0;
+      // Room for three operations of up to 21 characters per alignment
+      cigars.resize(2 + 64 * alignments.size());
+      uint64_t cigar_start = 2;
+      uint64_t cigar_end = cigar_start;
       uint64_t last_end = 0;
       for (uint64_t i = 0; i != alignments.size(); ++i) {
         Alignment * const a = sorted_alignments[i];
@@ -258,14 +293,14 @@ inline void Aligner::prepare_matches() {
         ++a->n_matches;
         a->n_unique_bases += a->length;
         if (a->prefix)
-          cigar_end += sprintf(&a->cigar[cigar_end], "%lu%c",
+          cigar_end += sprintf(&cigars[cigar_end], "%lu%c",
                                a->prefix - last_end,
                                last_end ? 'M' : 'S');
-        cigar_end += sprintf(&a->cigar[cigar_end], "%lu=", a->length);
+        cigar_end += sprintf(&cigars[cigar_end], "%lu=", a->length);
         if (!na || na->pos != a->pos || na->seq_index != a->seq_index ||
             na->rc != a->rc) {
           if (a->suffix)
-            cigar_end += sprintf(&a->cigar[cigar_end], "%luS", a->suffix);
+            cigar_end += sprintf(&cigars[cigar_end], "%luS", a->suffix);
 
           for (uint64_t j = 0; j != query.size(); ++j) {
             const int64_t ref_pos = a->rcpos + j;
@@ -273,12 +308,12 @@ inline void Aligner::prepare_matches() {
                 sa.ref[ref_pos] == query[j]) ++a->n_matched_bases;
           }
 
-          a->cigar.resize(cigar_end);
-          cigar_end = 0;
+          a->cigar = cigar_start;
+          cigar_start = cigar_end = cigar_end + 1;
           last_end = 0;
         } else {
+          // The last alignment of a merged block holds its cigar
           last_end = a->prefix + a->length;
-          a->cigar.swap(na->cigar);
           // ::swap(a->qpos, na->qpos);
           na->qpos = std::min(a->qpos, na->qpos);
           ::swap(a->n_matches, na->n_matches);
@@ -321,7 +356,9 @@ inline void Aligner::set_nomap() {
 
 inline void Aligner::run() {
   if (errors.empty()) errors.assign(query.size(), '!');
-  if (type == MAM) sa.MAM(*this);
+  if (type == MAM) {
+    if (sa.unique.empty() || !sa.unique_MAM(*this)) sa.MAM(*this);
+  }
   else if (type == MUM) sa.MUM(*this);
   else if (type == MEM) sa.MEM(*this);
   prepare_matches();
@@ -342,63 +379,106 @@ inline void Aligner::print_matches(OutputSorter & output) {
         exit(1);
       }
       if (sam_out) {
-        if (a->n_matches || (read_flag & is_unmapped)) {
-          if (read_flag & is_unmapped)
-            output.printf("%s\t%u\t%s\t%ld\t0\t%s",
-                          name.c_str(), read_flag,
-                          (a->best_mate ?
-                           sa.ref.descr[a->best_mate->seq_index].c_str() :
-                           "*"),
-                          (a->best_mate ? a->best_mate->pos + 1 : 0), "*");
-          else
-            output.printf("%s\t%u\t%s\t%ld\t50\t%s",
-                          name.c_str(), read_flag | (a->rc ? is_reversed : 0) |
-                          (a->alignment_index ? is_not_primary : 0),
-                          sa.ref.descr[a->seq_index].c_str(),
-                          a->pos + 1, &a->cigar[0]);
-          if (a->best_mate)
-            output.printf("\t%s\t%ld\t0",
-                          sa.ref.descr[a->best_mate->seq_index].c_str(),
-                          a->best_mate->pos + 1);
-          else
-            output.printf("\t*\t0\t0");
+        if (bam_out && (a->n_matches || (read_flag & is_unmapped))) {
+          print_bam(*a, output);
+        } else if (a->n_matches || (read_flag & is_unmapped)) {
+          const Alignment * const mate = a->best_mate;
+          const Alignment * const prev =
+              a->prev_alignment != a ? a->prev_alignment : nullptr;
+          const Alignment * const next =
+              a->next_alignment != a ? a->next_alignment : nullptr;
+          // Numbers, tags and tabs take under 512 characters
+          output.reserve(512 + name.size() + 2 * original.size() +
+                         errors.size() + optional.size() +
+                         4 * sa.ref.maxdescrlen + 3 * cigars.size());
+          output.write(name);
+          output.write('\t');
+          if (read_flag & is_unmapped) {
+            output.write_unsigned(read_flag);
+            output.write('\t');
+            if (mate) {
+              output.write(sa.ref.descr[mate->seq_index]);
+              output.write('\t');
+              output.write_signed(mate->pos + 1);
+            } else {
+              output.write("*\t0");
+            }
+            output.write("\t0\t*");
+          } else {
+            output.write_unsigned(read_flag | (a->rc ? is_reversed : 0) |
+                                  (a->alignment_index ? is_not_primary : 0));
+            output.write('\t');
+            output.write(sa.ref.descr[a->seq_index]);
+            output.write('\t');
+            output.write_signed(a->pos + 1);
+            output.write("\t50\t");
+            output.write(&cigars[a->cigar], strlen(&cigars[a->cigar]));
+          }
+          if (mate) {
+            output.write('\t');
+            output.write(sa.ref.descr[mate->seq_index]);
+            output.write('\t');
+            output.write_signed(mate->pos + 1);
+            output.write("\t0");
+          } else {
+            output.write("\t*\t0\t0");
+          }
+          output.write('\t');
           if (a->rc) {
             if (rcquery.empty()) {
               rcquery = original;
               reverse_complement(&rcquery);
             }
-            output.printf("\t%s\t", rcquery.c_str());
-            for (uint64_t j = errors.size(); j != 0 ; )
-              output.printf("%c", errors[--j]);
+            output.write(rcquery);
+            output.write('\t');
+            output.write_reversed(errors);
           } else {
-            output.printf("\t%s\t%s",
-                           original.c_str(), errors.c_str());
+            output.write(original);
+            output.write('\t');
+            output.write(errors);
           }
           if (a->n_matches) {
-            output.printf("\tXM:i:%lu\tXU:i:%lu\tXE:i:%lu"
-                          "\tXS:A:%c\tNH:i:%lu\tHI:i:%lu",
-                          a->n_matches, a->n_unique_bases,
-                          a->n_matched_bases,
-                          a->rc ? '-' : '+', n_alignments, a->alignment_index);
+            output.write("\tXM:i:");
+            output.write_unsigned(a->n_matches);
+            output.write("\tXU:i:");
+            output.write_unsigned(a->n_unique_bases);
+            output.write("\tXE:i:");
+            output.write_unsigned(a->n_matched_bases);
+            output.write("\tXS:A:");
+            output.write(a->rc ? '-' : '+');
+            output.write("\tNH:i:");
+            output.write_unsigned(n_alignments);
+            output.write("\tHI:i:");
+            output.write_unsigned(a->alignment_index);
           } else {
-            output.printf("\tXM:i:0\tNH:i:0");
+            output.write("\tXM:i:0\tNH:i:0");
           }
-          if (a->prev_alignment && a->prev_alignment != a) {
-            const Alignment * const prev = a->prev_alignment;
-            output.printf("\tcc:Z:%s\tcp:i:%ld\txo:A:%c\txc:Z:%s",
-                          sa.ref.descr[prev->seq_index].c_str(),
-                          prev->pos + 1, prev->rc == a->rc ? '=' : '!',
-                          &prev->cigar[0]);
+          if (prev) {
+            output.write("\tcc:Z:");
+            output.write(sa.ref.descr[prev->seq_index]);
+            output.write("\tcp:i:");
+            output.write_signed(prev->pos + 1);
+            output.write("\txo:A:");
+            output.write(prev->rc == a->rc ? '=' : '!');
+            output.write("\txc:Z:");
+            output.write(&cigars[prev->cigar], strlen(&cigars[prev->cigar]));
           }
-          if (a->next_alignment && a->next_alignment != a) {
-            const Alignment * const next = a->next_alignment;
-            output.printf("\tCC:Z:%s\tCP:i:%ld\tXO:A:%c\tXC:Z:%s",
-                          sa.ref.descr[next->seq_index].c_str(),
-                          next->pos + 1, next->rc == a->rc ? '=' : '!',
-                          &next->cigar[0]);
+          if (next) {
+            output.write("\tCC:Z:");
+            output.write(sa.ref.descr[next->seq_index]);
+            output.write("\tCP:i:");
+            output.write_signed(next->pos + 1);
+            output.write("\tXO:A:");
+            output.write(next->rc == a->rc ? '=' : '!');
+            output.write("\tXC:Z:");
+            output.write(&cigars[next->cigar], strlen(&cigars[next->cigar]));
           }
-          if (optional.size()) output.printf("%s", optional.c_str());
-          output.printf("\n");
+          if (partial_map) {
+            output.write("\tXB:i:");
+            output.write_unsigned(work);
+          }
+          output.write(optional);
+          output.write('\n');
           output.end_line();
         }
       } else {
@@ -414,6 +494,74 @@ inline void Aligner::print_matches(OutputSorter & output) {
   }
 }
 
+// The fields and tags of the SAM line above, encoded straight into BAM
+inline void Aligner::print_bam(const Alignment & a, OutputSorter & output) {
+  const Alignment * const mate = a.best_mate;
+  const Alignment * const prev =
+      a.prev_alignment != &a ? a.prev_alignment : nullptr;
+  const Alignment * const next =
+      a.next_alignment != &a ? a.next_alignment : nullptr;
+  // References are numbered in header order, without reverse complements
+  const uint64_t ref_step = sa.ref.rcref ? 2 : 1;
+  const int32_t mate_ref_id = mate ? mate->seq_index / ref_step : -1;
+  const int32_t mate_pos = mate ? mate->pos : -1;
+  if (a.rc && rcquery.empty()) {
+    rcquery = original;
+    reverse_complement(&rcquery);
+  }
+  const string & bases = a.rc ? rcquery : original;
+  const uint64_t n_bases = bases == "*" ? 0 : bases.size();
+  const bool no_qualities = errors == "*";
+  if (!no_qualities && errors.size() != n_bases)
+    throw Error("SAM qualities and bases differ in length") << name;
+  BamRecord & record = output.record();
+  if (read_flag & is_unmapped) {
+    record.start(name.data(), name.size(), read_flag, mate_ref_id, mate_pos,
+                 0, "*", nullptr, mate_ref_id, mate_pos, 0,
+                 bases.data(), n_bases,
+                 no_qualities ? nullptr : errors.data(), a.rc);
+  } else {
+    const char * const cigar = &cigars[a.cigar];
+    record.start(name.data(), name.size(),
+                 read_flag | (a.rc ? is_reversed : 0) |
+                 (a.alignment_index ? is_not_primary : 0),
+                 a.seq_index / ref_step, a.pos, 50,
+                 cigar, cigar + strlen(cigar), mate_ref_id, mate_pos, 0,
+                 bases.data(), n_bases,
+                 no_qualities ? nullptr : errors.data(), a.rc);
+  }
+  if (a.n_matches) {
+    record.add_integer("XM", a.n_matches);
+    record.add_integer("XU", a.n_unique_bases);
+    record.add_integer("XE", a.n_matched_bases);
+    record.add_char("XS", a.rc ? '-' : '+');
+    record.add_integer("NH", n_alignments);
+    record.add_integer("HI", a.alignment_index);
+  } else {
+    record.add_integer("XM", 0);
+    record.add_integer("NH", 0);
+  }
+  if (prev) {
+    const string & chromosome = sa.ref.descr[prev->seq_index];
+    const char * const cigar = &cigars[prev->cigar];
+    record.add_string("cc", chromosome.data(), chromosome.size());
+    record.add_integer("cp", prev->pos + 1);
+    record.add_char("xo", prev->rc == a.rc ? '=' : '!');
+    record.add_string("xc", cigar, strlen(cigar));
+  }
+  if (next) {
+    const string & chromosome = sa.ref.descr[next->seq_index];
+    const char * const cigar = &cigars[next->cigar];
+    record.add_string("CC", chromosome.data(), chromosome.size());
+    record.add_integer("CP", next->pos + 1);
+    record.add_char("XO", next->rc == a.rc ? '=' : '!');
+    record.add_string("XC", cigar, strlen(cigar));
+  }
+  if (partial_map) record.add_integer("XB", work);
+  record.add_sam_tags(optional.data(), optional.data() + optional.size());
+  output.end_record();
+}
+
 inline bool Aligner::has_mate(const Aligner & read2) const {
   return (read_flag & is_first) && (read2.read_flag & is_second);
 }
@@ -445,13 +593,143 @@ void Aligner::set_print(const bool print_) { print = print_; }
 
 
 // OutputSorter
+OutputSorter::OutputSorter(const std::string header_, const bool bam_,
+                           const uint64_t buffer_size_,
+                           const uint64_t max_line_size_) :
+    header(header_), bam(bam_), buffer_size(buffer_size_),
+    max_line_size(max_line_size_), buffer(buffer_size) {
+  if (bam) {
+    // Reference lengths from the @SQ lines, for absolute positions
+    uint64_t offset = 0;
+    istringstream lines(header);
+    string line;
+    while (getline(lines, line)) {
+      if (line.compare(0, 4, "@SQ\t")) continue;
+      const uint64_t length_start = line.find("\tLN:");
+      if (length_start == string::npos)
+        throw Error("@SQ header line needs LN") << line;
+      reference_offsets.push_back(offset);
+      offset += atol(line.c_str() + length_start + 4);
+    }
+    reference_offsets.push_back(offset);
+  }
+}
+
+// Two decimal digits for each number below 100
+static const class DigitPairs {
+ public:
+  DigitPairs() {
+    for (unsigned int n = 0; n != 100; ++n) {
+      pairs[2 * n] = '0' + n / 10;
+      pairs[2 * n + 1] = '0' + n % 10;
+    }
+  }
+  char pairs[200];
+} digit_pairs;
+
+inline void OutputSorter::write_unsigned(uint64_t value) {
+  char digits[20];
+  char * start = digits + sizeof(digits);
+  while (value >= 100) {
+    start -= 2;
+    memcpy(start, digit_pairs.pairs + 2 * (value % 100), 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    start -= 2;
+    memcpy(start, digit_pairs.pairs + 2 * value, 2);
+  } else {
+    *--start = '0' + value;
+  }
+  write(start, digits + sizeof(digits) - start);
+}
+
+// Only called at the start of a line
+void OutputSorter::reserve(const uint64_t bytes) {
+  if (end + bytes + 1 > buffer_size) flush();
+  if (end + bytes + 1 > buffer_size)
+    throw Error("output line could be too long for buffer") << bytes;
+}
+
+void OutputSorter::end_record() {
+  const uint64_t size = bam_record.size();
+  reserve(size);
+  const char * const data = bam_record.data();
+  memcpy(&buffer[end], data, size);
+  int32_t ref_id;
+  int32_t pos;
+  memcpy(&ref_id, data + 4, sizeof(ref_id));
+  memcpy(&pos, data + 8, sizeof(pos));
+  if (ref_id < -1 ||
+      ref_id + 1 >= static_cast<int64_t>(reference_offsets.size()))
+    throw Error("BAM reference id not in header") << ref_id;
+  bam_reads.emplace_back(&buffer[end], (ref_id == -1 ?
+                         reference_offsets.back() :
+                         reference_offsets[ref_id]) + pos + 1);
+  end += size;
+  begin = end;
+}
+
+// LSD radix sort on name prefix then position, a byte at a time,
+// skipping bytes that are the same in every key
+template <class Key>
+static void radix_sort(vector<Key> & keys, vector<Key> & scratch) {
+  const uint64_t n = keys.size();
+  if (n < 2) return;
+  const unsigned int n_digits = 16;
+  auto digit_of = [](const Key & key, const unsigned int digit) {
+    return digit < 8 ? (key.name_prefix >> (8 * digit)) & 255 :
+        (key.position >> (8 * (digit - 8))) & 255;
+  };
+  vector<uint64_t> counts(n_digits * 256);
+  for (const Key & key : keys)
+    for (unsigned int digit = 0; digit != n_digits; ++digit)
+      ++counts[digit * 256 + digit_of(key, digit)];
+  scratch.resize(n);
+  for (unsigned int digit = 0; digit != n_digits; ++digit) {
+    uint64_t * const count = &counts[digit * 256];
+    if (count[digit_of(keys[0], digit)] == n) continue;
+    uint64_t total = 0;
+    for (unsigned int b = 0; b != 256; ++b) {
+      const uint64_t bucket = count[b];
+      count[b] = total;
+      total += bucket;
+    }
+    for (const Key & key : keys)
+      scratch[count[digit_of(key, digit)]++] = key;
+    keys.swap(scratch);
+  }
+}
+
+// Only keys that share position and name prefix need a full compare
+template <class Key>
+static void sort_keys(vector<Key> & keys, vector<Key> & scratch) {
+  radix_sort(keys, scratch);
+  for (auto run = keys.begin(); run != keys.end();) {
+    auto run_end = run + 1;
+    while (run_end != keys.end() && run->same_prefix(*run_end)) ++run_end;
+    if (run_end - run > 1) sort(run, run_end);
+    run = run_end;
+  }
+}
+
 void OutputSorter::flush() {
   if (end) {
     mkdir("mapout");
-    sort(output_reads.begin(), output_reads.end());
     ostringstream file_name;
     file_name << "mapout/mapout" << (uint64_t)this << "."
-              << ++file_sequence << ".txt";
+              << ++file_sequence << (bam ? ".bam" : ".txt");
+    if (bam) {
+      sort_keys(bam_reads, sorted_bam_reads);
+      BamWriter out(file_name.str(), header);
+      for (const auto read : bam_reads) out.add_record(read.data);
+      out.close();
+      begin = 0;
+      end = 0;
+      bam_reads.clear();
+      return;
+    }
+    sort_keys(output_reads, sorted_reads);
     FILE * out = fopen(file_name.str().c_str(), "wb");
     if (out == nullptr) {
       throw Error("Problem opening out file");
@@ -467,56 +745,61 @@ void OutputSorter::flush() {
   }
 }
 
+// QueryBatch
+const uint64_t QueryBatch::capacity;
+
 // Pair
 Pair::Pair(const PairArgs & args, const longSA & sa_)
-    : PairArgs(args), queue(1000UL, NewQuery(args), true, false, true),
-      n_queries(0), read1(args, sa_), read2(args, sa_),
-      output(sa_.ref.sam_header()) {
+    : PairArgs(args), batches(nullptr), pool(nullptr), worker(0),
+      n_queries(0), n_partial(0), n_allocations(0), n_counted(0),
+      read1(args, sa_), read2(args, sa_),
+      output(sa_.ref.sam_header(), bam_out) {
 }
 Pair::Pair(const Pair & other)
-    : PairArgs(other), queue(other.queue), n_queries(other.n_queries),
+    : PairArgs(other), batches(other.batches), pool(other.pool),
+      worker(other.worker),
+      n_queries(other.n_queries), n_partial(other.n_partial),
+      n_allocations(other.n_allocations), n_counted(other.n_counted),
       read1(other.read1), read2(other.read2), output(other.output) {
 }
 
 inline void Pair::run() {
-  NewQuery * new_query = nullptr;
-  uint64_t n_print = 0;
-  uint64_t not_ready = 0;
-  while (1) {
-    while ((new_query = queue.first()) == nullptr) ++not_ready;
-    const bool second = n_queries++ % 2;
-    Aligner & read = second ? read2 : read1;
-    if (new_query->complete()) {
-      if (0) cerr << "got query " << new_query->name
-                  << " with size " << new_query->query.size() << endl;
-      read.reset(*new_query);
-      queue.yield();
+  QueryBatch * batch = nullptr;
+  while (batches->pop(worker, batch)) {
+#ifdef COUNT_ALLOCATIONS
+    const uint64_t allocations_before = n_thread_allocations;
+#endif
+    for (uint64_t q = 0; q != batch->size; ++q) {
+      const bool second = q % 2;
+      Aligner & read = second ? read2 : read1;
+      read.reset(batch->queries[q]);
       read.run();
-    } else {
-      // cerr << "# incomplete query - finished" << endl;
-      --n_queries;
-      queue.yield();
-      break;
-    }
-    if (second) {
-      if (read1.has_mate(read2)) {
-        read1.set_mate(read2);
-        read2.set_mate(read1);
+      if (read.partial()) ++n_partial;
+      if (second) {
+        if (read1.has_mate(read2)) {
+          read1.set_mate(read2);
+          read2.set_mate(read1);
+        }
+        read1.print_matches(output);
+        read2.print_matches(output);
+        read1.clear();
+        read2.clear();
       }
+    }
+    if (batch->size % 2) {
       read1.print_matches(output);
-      read2.print_matches(output);
       read1.clear();
-      read2.clear();
-      n_print += 2;
     }
-  }
-  if ((n_queries % 2) == 1) {
-    read1.print_matches(output);
-    read1.clear();
-    ++n_print;
+#ifdef COUNT_ALLOCATIONS
+    if (n_queries) {  // after the first batch, while buffers grow
+      n_allocations += n_thread_allocations - allocations_before;
+      n_counted += batch->size;
+    }
+#endif
+    n_queries += batch->size;
+    pool->push(batch);
   }
   output.flush();
-  if (not_ready) cerr << "No query available " << not_ready << " times" << endl;
 }
 
 void * Pair::runner_thread(void * obj) {
@@ -536,68 +819,88 @@ void * Pair::runner_thread(void * obj) {
 
 Pairs::Pairs(const PairsArgs & args, const longSA & sa)
     : PairsArgs(args), start_time(time(nullptr)), thread_ids(n_threads),
-      pairs(n_threads, Pair(args, sa)),
-      available(n_threads, nullptr, true, false, true) {
+      pool_batches(2 * n_threads + 2, QueryBatch(args)),
+      pool(pool_batches.size()), batches(n_threads, pool_batches.size()),
+      pairs(n_threads, Pair(args, sa)) {
   if (verbose)
     cerr << "# running " << n_threads << " thread"
          << (n_threads > 1 ? "s" : "") << " to answer queries" << endl;
   // if (sam_out) sa.ref.print_sam_header();
   // Set up chromosome map for absolute position determination
   uint64_t offset = 0;
-  for (unsigned int i = 0; i < sa.ref.descr.size(); i += 2) {
+  for (unsigned int i = 0; i < sa.ref.descr.size();
+       i += sa.ref.rcref ? 2 : 1) {
     // cerr << sa.ref.descr[i] << " " << offset << endl;
     MemSam::chromosomes[sa.ref.descr[i]] = offset;
     offset += sa.ref.sizes[i];
   }
   MemSam::chromosomes["*"] = offset;
+  // Readers wait for a free batch when all are queued or being mapped
+  for (QueryBatch & batch : pool_batches) pool.push(&batch);
   // Initialize pairs and start threads
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
   for (unsigned int thread = 0; thread != n_threads; ++thread) {
+    pairs[thread].batches = &batches;
+    pairs[thread].pool = &pool;
+    pairs[thread].worker = thread;
     if (pthread_create(&thread_ids[thread], &attr, &Pair::runner_thread,
                        &pairs[thread]))
       throw Error("Problem creating runner_thread") << thread;
-    release_pair(&pairs[thread]);
   }
 }
 
 Pairs::~Pairs() {
   uint64_t n_processed = 0;
+  uint64_t n_partial = 0;
+  uint64_t n_allocations = 0;
+  uint64_t n_counted = 0;
   for (unsigned int t = 0; t != n_threads; ++t) {
     pthread_join(thread_ids[t], nullptr);
     n_processed += pairs[t].n_queries;
+    n_partial += pairs[t].n_partial;
+    n_allocations += pairs[t].n_allocations;
+    n_counted += pairs[t].n_counted;
   }
+#ifdef COUNT_ALLOCATIONS
+  cerr << "# " << n_allocations << " heap allocations while mapping "
+       << n_counted << " queries after the first batch of each thread"
+       << endl;
+#endif
   if (verbose) cerr << "# ran " << n_processed << " queries in "
                     << time(nullptr) - start_time << " seconds" << endl;
+  if (verbose) cerr << "# query batches were stolen " << batches.steals()
+                    << " times and workers waited " << batches.idle_waits()
+                    << " times for reads" << endl;
+  if (verbose && max_work) cerr << "# " << n_partial << " queries ran out of "
+                                << "work budget and were partially mapped"
+                                << endl;
 }
 
-inline Pair * Pairs::get_pair() {
-  return available.pop();
-}
-
-inline void Pairs::switch_pair(Pair * & pair) {
-  Pair * temp = available.pop();
-  available.push(pair);
-  pair = temp;
+QueryBatch * Pairs::new_batch() {
+  QueryBatch * batch = pool.pop();
+  batch->size = 0;
+  return batch;
 }
 
-inline void Pairs::release_pair(Pair * pair) {
-  available.push(pair);
+inline void Pairs::publish(QueryBatch * batch) {
+  if (batch->size) {
+    batches.push(batch);
+  } else {
+    pool.push(batch);
+  }
 }
 
 inline void Pairs::done() {
-  NewQuery * query = nullptr;
-  for (vector<Pair>::iterator pair = pairs.begin(); pair != pairs.end();
-       ++pair) {
-    while ((query = pair->queue.next(0)) == nullptr) continue;
-    query->clear();
-    pair->queue.commit();
-  }
+  batches.close();
 }
+
 QueryReader::QueryReader(const ReaderArgs & args, Pairs & pairs_,
                          const char * const query_input_ = nullptr) :
-    ReaderArgs(args), n_sequences(0), pairs(pairs_), n_full(0) {
+    ReaderArgs(args), n_sequences(0), pairs(pairs_), parse_seconds(0),
+    run_seconds(0), input_bytes(0), file_bytes(0), gzip_input(false),
+    n_skipped(0) {
   query_input = query_input_;
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -606,82 +909,198 @@ QueryReader::QueryReader(const ReaderArgs & args, Pairs & pairs_,
 QueryReader::~QueryReader() {
   pthread_attr_destroy(&attr);
   if (query_input && verbose) {
-    cerr << "# query reader for " << query_input << " processed "
-         << n_sequences << " sequences" << endl;
+    cerr << "# query reader for " << query_input;
+    if (mate_input) cerr << " and " << mate_input;
+    cerr << " processed " << n_sequences << " sequences";
+    if (parse_seconds > 0)
+      cerr << ", parsing " << static_cast<uint64_t>(n_sequences /
+                                                    parse_seconds)
+           << " reads per second";
+    if (run_seconds > 0) {
+      cerr << ", reading " << input_bytes / run_seconds / 1E6 << " MB/s";
+      if (gzip_input)
+        cerr << " inflated from " << file_bytes / run_seconds / 1E6
+             << " MB/s of gzip";
+    }
+    cerr << endl;
+    if (n_skipped)
+      cerr << "# skipped " << n_skipped << " read pairs with an empty read"
+           << endl;
   }
 }
 
-inline void QueryReader::run() {
-  ifstream data(query_input);
-  if (!data) throw Error("unable to open") << query_input;
+// Get next query from batch, handing over full batches
+inline void QueryReader::get_query(QueryBatch * & batch, NewQuery * & query) {
+  if (batch == nullptr || batch->full()) {
+    const double start = seconds_since_start();
+    if (batch != nullptr) pairs.publish(batch);
+    batch = pairs.new_batch();
+    parse_seconds -= seconds_since_start() - start;
+  }
+  query = &batch->queries[batch->size++];
+  ++n_sequences;
+}
 
-  Pair * pair = pairs.get_pair();
+inline void QueryReader::read_single(LineReader & data,
+                                     QueryBatch * & batch) {
   NewQuery * query = nullptr;
   const char start_char = fastq ? '@' : '>';
-  string meta;
-  string line;
-  string name, ref, pos, mapq, cigar, mref, mpos, tlen, seq, errors, optional;
-  unsigned int flag;
-  while (data) {
-    getline(data, line);
-    if (line.size()) {
-      // Get next query from buffer
-      if ((n_sequences++ % 2) == 0) {
-        while ((query = pair->queue.next()) == nullptr) {
-          // Get available pair to own if pair query buffer is full
-          pairs.switch_pair(pair);
-          ++n_full;
-        }
-      } else {
-        ++query;  // Assumes NewQuery ring buffer has even size
+  const char * line;
+  uint64_t length;
+  while (data.next(line, length)) {
+    if (!length) continue;
+    // Start of new sequence
+    if (sam_in) {
+      if (line[0] == '@') continue;  // header
+      // Split the eleven mandatory fields on tabs
+      const char * const line_end = line + length;
+      const char * fields[11];
+      uint64_t lengths[11];
+      const char * field = line;
+      for (unsigned int f = 0; f != 11; ++f) {
+        const char * tab = static_cast<const char *>(
+            memchr(field, '\t', line_end - field));
+        if (tab == nullptr) tab = line_end;
+        fields[f] = field;
+        lengths[f] = tab - field;
+        field = tab == line_end ? line_end : tab + 1;
       }
-      // Start of new sequence
-      if (sam_in) {
-        istringstream input(line);
-        input >> name >> flag >> ref >> pos >> mapq >> cigar
-              >> mref >> mpos >> tlen >> seq >> errors;
-        if (flag & is_first) name += ":0";
-        else if (flag & is_second) name += ":1";
-        query->reset(name);
-        query->extend(seq);
-        query->set_errors(errors);
-        while (input >> optional) query->add_optional(optional);
-      } else {
-        uint64_t start = 0, end = line.length();
-        if (line[0] != start_char)
-          throw Error("missing query start character") << start_char <<
-              "in input line" << line;
-
-        // Process query name
-        trim(line, start = 1, end);
-        for (uint64_t i = start; start < end && i < end; ++i) {
-          if (line[i] == ' ') {  // done with name
-            if (i + 1 != end) {  // look for illumina mate info
-              if (line[i+1] == '1') {
-                meta += ":0";
-              } else if (line[i+1] == '2') {
-                meta += ":1";
-              }
-            }
-            break;
-          }
-          meta += line[i];
-        }
-        query->reset(meta);
-        // Collect sequence data.
-        getline(data, line);
-        if (line.empty()) throw Error("empty sequence");
-        query->extend(line);
-        if (fastq) {  // Assumes one line for errors, no spaces
-          getline(data, line);
-          getline(data, line);
-          query->set_errors(line);
+      unsigned int flag = 0;
+      for (uint64_t c = 0; c != lengths[1] &&
+               fields[1][c] >= '0' && fields[1][c] <= '9'; ++c)
+        flag = flag * 10 + fields[1][c] - '0';
+      get_query(batch, query);
+      query->reset(fields[0], lengths[0]);
+      if (flag & is_first) query->name += ":0";
+      else if (flag & is_second) query->name += ":1";
+      query->extend(fields[9], lengths[9]);
+      query->set_errors(fields[10], lengths[10]);
+      while (field < line_end) {
+        const char * tab = static_cast<const char *>(
+            memchr(field, '\t', line_end - field));
+        if (tab == nullptr) tab = line_end;
+        if (tab != field) query->add_optional(field, tab - field);
+        field = tab + 1;
+      }
+    } else {
+      if (line[0] != start_char) {
+        const string bad_line(line, length);
+        throw Error("missing query start character") << start_char <<
+            "in input line" << bad_line;
+      }
+
+      // Process query name, up to a space
+      uint64_t start = 1;
+      uint64_t end = length;
+      while (start != end && line[start] == ' ') ++start;
+      while (end > start && line[end - 1] == ' ') --end;
+      const char * const space = static_cast<const char *>(
+          memchr(line + start, ' ', end - start));
+      get_query(batch, query);
+      query->reset(line + start, (space ? space : line + end) - line - start);
+      if (space && space + 1 != line + end) {  // look for illumina mate info
+        if (space[1] == '1') {
+          query->name += ":0";
+        } else if (space[1] == '2') {
+          query->name += ":1";
         }
       }
-      pair->queue.commit();
+      // Collect sequence data.
+      if (!data.next(line, length) || !length)
+        throw Error("empty sequence");
+      query->extend(line, length);
+      if (fastq) {  // Assumes one line for errors, no spaces
+        if (!data.next(line, length) || !data.next(line, length)) length = 0;
+        query->set_errors(line, length);
+      }
+    }
+  }
+}
+
+// Parse one fastq or fasta record of a paired file, as fastqs_to_sam
+// did, keeping the first word of the comment as an XO tag
+inline bool QueryReader::read_mate(LineReader & data, NewQuery & query,
+                                   const bool second) {
+  const char * line;
+  uint64_t length;
+  do {
+    if (!data.next(line, length)) return false;
+  } while (!length);
+  const char start_char = line[0];
+  if (start_char != '@' && start_char != '>') {
+    const string bad_line(line, length);
+    throw Error("missing fastq start character in input line") << bad_line;
+  }
+  const char * const line_end = line + length;
+  const char * name = line + 1;
+  while (name != line_end && isspace(*name)) ++name;
+  const char * name_end = name;
+  while (name_end != line_end && !isspace(*name_end)) ++name_end;
+  const char * comment = name_end;
+  while (comment != line_end && isspace(*comment)) ++comment;
+  const char * comment_end = comment;
+  while (comment_end != line_end && !isspace(*comment_end)) ++comment_end;
+  if (name == name_end) throw Error("missing read name in") << data.name();
+  query.reset(name, name_end - name);
+  query.name += second ? ":1" : ":0";
+  if (comment != comment_end) {
+    query.optional += "\tXO:Z:";
+    query.optional.append(comment, comment_end - comment);
+  }
+  if (!data.next(line, length)) length = 0;
+  query.extend(line, length);
+  if (start_char == '@') {
+    if (!data.next(line, length) || !length || line[0] != '+')
+      throw Error("fastq + line missing in") << data.name();
+    if (!data.next(line, length)) length = 0;
+    if (!query.original.empty()) query.set_errors(line, length);
+  } else {
+    query.errors = query.original;
+  }
+  return true;
+}
+
+// Mates are read in lockstep and placed next to each other in a batch
+inline void QueryReader::read_paired(LineReader & data, LineReader & mates,
+                                     QueryBatch * & batch) {
+  NewQuery * query = nullptr;
+  NewQuery * mate = nullptr;
+  while (true) {
+    get_query(batch, query);
+    get_query(batch, mate);
+    const bool got_read = read_mate(data, *query, false);
+    const bool got_mate = read_mate(mates, *mate, true);
+    if (got_read != got_mate)
+      throw Error("paired files have different numbers of reads:")
+          << data.name() << mates.name();
+    if (!got_read || query->original.empty() || mate->original.empty()) {
+      batch->size -= 2;
+      n_sequences -= 2;
+      if (!got_read) break;
+      ++n_skipped;
     }
   }
-  pairs.release_pair(pair);
+}
+
+inline void QueryReader::run() {
+  const double start_seconds = seconds_since_start();
+  LineReader data(query_input);
+  QueryBatch * batch = nullptr;
+  if (mate_input == nullptr) {
+    read_single(data, batch);
+  } else {
+    LineReader mates(mate_input);
+    read_paired(data, mates, batch);
+    input_bytes = mates.bytes();
+    file_bytes = mates.file_bytes();
+    gzip_input = mates.compressed();
+  }
+  if (batch != nullptr) pairs.publish(batch);
+  run_seconds = seconds_since_start() - start_seconds;
+  parse_seconds += run_seconds;
+  input_bytes += data.bytes();
+  file_bytes += data.file_bytes();
+  gzip_input = gzip_input || data.compressed();
 
   if (!n_sequences) cerr << "# no reads processed" << endl;
 }
@@ -713,12 +1132,17 @@ void QueryReader::join() {
 Readers::Readers(const ReadersArgs & args, Pairs & pairs_)
     : ReadersArgs(args), start_time(time(nullptr)), pairs(pairs_),
       readers(args.n_input, QueryReader(args, pairs_)) {
+  for (unsigned int r = 0; r != args.n_input; ++r)
+    readers[r].query_input = args.input[r];
+  if (fastq1) {
+    readers.push_back(QueryReader(args, pairs_));
+    readers.back().query_input = fastq1;
+    readers.back().mate_input = fastq2;
+  }
   if (verbose) cerr << "# running " << readers.size() << " query reader"
                     << (readers.size() > 1 ? "s" : "") << endl;
-  for (unsigned int r = 0; r != readers.size(); ++r) {
-    readers[r].query_input = args.input[r];
+  for (unsigned int r = 0; r != readers.size(); ++r)
     readers[r].run_in_thread();
-  }
 }
 Readers::~Readers() {
   // Wait for reading threads to finish
@@ -3,10 +3,13 @@
 #ifndef LONGMEM_QUERY_H_
 #define LONGMEM_QUERY_H_
 
+#include <string.h>
+
 #include <algorithm>
 #include <string>
 #include <vector>
 
+#include "./bam.h"
 #include "./locked.h"
 #include "./longSA.h"
 #include "./util.h"
@@ -30,7 +33,7 @@ struct Alignment {
   Alignment * prev_alignment;  // linked list of alignments
   Alignment * next_alignment;  // linked list of alignments
   Alignment * best_mate;  // not the best, just preferred
-  std::vector<char> cigar;  // cigar string
+  uint64_t cigar;  // offset of cigar string in Aligner cigars
   bool rc;  // was query mapped to reversed reference?
 #ifdef use_ctr
   Alignment();
@@ -46,7 +49,7 @@ struct Alignment {
 
 struct Query {
   void clear();
-  void swap(Query & other);
+  void assign(const Query & other);  // reusing string capacity
   std::string name;
   std::string query;
   std::string original;
@@ -65,28 +68,41 @@ class NewQueryArgs {
 class NewQuery : public Query, public NewQueryArgs {
  public:
   explicit NewQuery(const NewQueryArgs & args);
-  void reset(std::string & name_);
-  void extend(const std::string & line);
-  void set_errors(std::string & line);
-  void add_optional(std::string & opt);
-  bool complete() const;
+  // Fields are copied from views into the input buffer
+  void reset(const char * name_, const uint64_t length);
+  void extend(const char * line, const uint64_t length);
+  void set_errors(const char * line, const uint64_t length);
+  void add_optional(const char * opt, const uint64_t length);
 
  private:
   NewQuery & operator=(const NewQuery & disabled_assignment_operator);
 };
 
+// Consecutive reads handed from a reader to a Pair worker as a unit.
+// Filled to an even size, except at the end of input, so mates stay
+// together.  Batches are recycled through a pool, so reads are parsed
+// into queries whose strings already have capacity.
+struct QueryBatch {
+  static const uint64_t capacity = 2048;  // 1024 read pairs
+  explicit QueryBatch(const NewQueryArgs & args)
+      : queries(capacity, NewQuery(args)), size(0) {}
+  bool full() const { return size == capacity; }
+  std::vector<NewQuery> queries;
+  uint64_t size;
+};
+typedef WorkStealingQueue<QueryBatch *> BatchQueue;
+typedef RingBuffer<QueryBatch *> BatchPool;
+
 
 class OutputSorter {
  public:
-  OutputSorter(const std::string header_,
+  OutputSorter(const std::string header_, const bool bam_ = false,
                const uint64_t buffer_size_ = 500000000,
-               const uint64_t max_line_size_ = 10000) :
-      header(header_), buffer_size(buffer_size_), max_line_size(max_line_size_),
-      buffer(buffer_size) {}
+               const uint64_t max_line_size_ = 10000);
   void end_line() {
     buffer[end++] = '\0';
     // cerr << "end line " << begin << " " << end << endl;
-    output_reads.emplace_back(&buffer[begin]);
+    output_reads.emplace_back(&buffer[begin], chromosome);
     // Prepare for next line
     begin = end;
     const uint64_t needed_size = end + max_line_size;
@@ -101,22 +117,57 @@ class OutputSorter {
     end += vsprintf(&buffer[end], format, args);
     va_end(args);
   }
+  // Direct formatting of a line whose size was first bounded by reserve
+  void reserve(const uint64_t bytes);
+  void write(const char * text, const uint64_t length) {
+    memcpy(&buffer[end], text, length);
+    end += length;
+  }
+  template <uint64_t size>  // string literal
+  void write(const char (&text)[size]) { write(text, size - 1); }
+  void write(const std::string & text) { write(text.data(), text.size()); }
+  void write(const char c) { buffer[end++] = c; }
+  void write_reversed(const std::string & text) {
+    std::reverse_copy(text.begin(), text.end(), &buffer[end]);
+    end += text.size();
+  }
+  void write_unsigned(uint64_t value);
+  void write_signed(const int64_t value) {
+    if (value < 0) {
+      write('-');
+      write_unsigned(-static_cast<uint64_t>(value));
+    } else {
+      write_unsigned(value);
+    }
+  }
+  // In BAM mode, a record is encoded in record() and then added whole
+  BamRecord & record() { return bam_record; }
+  void end_record();
 
  private:
   std::string header;
+  bool bam;
   uint64_t buffer_size;
   uint64_t max_line_size;
   uint64_t begin = 0;
   uint64_t end = 0;
   uint32_t file_sequence = 0;
   std::vector<char> buffer;
-  std::vector<MemSam> output_reads;
+  std::vector<SamKey> output_reads;
+  std::vector<SamKey> sorted_reads;  // radix sort scratch
+  std::string chromosome;  // key lookup buffer
+  BamRecord bam_record;
+  std::vector<BamKey> bam_reads;
+  std::vector<BamKey> sorted_bam_reads;
+  // Absolute start of each reference in header order, then the total
+  std::vector<uint64_t> reference_offsets;
 };
 
 class OutputArgs {
  public:
-  OutputArgs() : sam_out(false), nomap(false) {}
+  OutputArgs() : sam_out(false), bam_out(false), nomap(false) {}
   bool sam_out;
+  bool bam_out;  // sam_out encoded as BAM
   bool nomap;
 
  private:
@@ -126,10 +177,12 @@ class OutputArgs {
 enum mum_t { MUM, MAM, MEM };
 class AlignerArgs : public OutputArgs {
  public:
-  AlignerArgs() : OutputArgs(), type(MAM), min_len(20), min_block(20) {}
+  AlignerArgs() : OutputArgs(), type(MAM), min_len(20), min_block(20),
+                  max_work(0) {}
   mum_t type;
   unsigned int min_len;
   unsigned int min_block;
+  uint64_t max_work;  // per read work budget, 0 for none
  private:
   AlignerArgs & operator=(const AlignerArgs & disabled_assignment_operator);
 };
@@ -140,29 +193,49 @@ class Aligner : public Query, public AlignerArgs {
   Aligner(const AlignerArgs & args, const longSA & sa_);
   Aligner(const Aligner & other);
   void clear();
-  void reset(NewQuery & new_query);
+  void reset(const NewQuery & new_query);
   void set_nomap();
   void run();
   void print_matches(OutputSorter & output);
   bool has_mate(const Aligner & read2) const;
   void set_mate(const Aligner & other);
+  bool partial() const { return partial_map; }
   // Used by longSA class
   const std::string & operator()() const { return query; }
+  // Suffix array probes and suffix link steps spent on this read
+  uint64_t work;
+  // Checked before more search work: once over budget, the search is
+  // cut short and the read is marked partially mapped
+  bool out_of_budget() {
+    if (max_work && work > max_work) partial_map = true;
+    return partial_map;
+  }
   void process_match(const match_t & match);
   void forget(std::vector<match_t> & matches_);
+  // Cleared match buffer reused from read to read
+  std::vector<match_t> & scratch_matches() {
+    scratch.clear();
+    return scratch;
+  }
   void set_print(const bool print_);
 
  private:
   void prepare_matches();
+  void print_bam(const Alignment & a, OutputSorter & output);
   const longSA & sa;
   std::string rcquery;
   bool print;
+  bool partial_map;  // search stopped when work budget ran out
   unsigned int read_flag;
   Alignment * best_alignment;
   std::vector<match_t> matches;
+  std::vector<match_t> scratch;
   std::vector<Alignment> alignments;
   std::vector<Alignment *> sorted_alignments;
   uint64_t n_alignments;
+  // Cigar strings of this read, written one after another from offset 2
+  // after "*" at offset 0, and reused by the next read
+  std::vector<char> cigars;
   Aligner & operator=(const Aligner & disabled_assignment_operator);
 };
 
@@ -178,8 +251,13 @@ class Pair : public PairArgs {
   Pair(const PairArgs & args, const longSA & sa_);
   Pair(const Pair & other);
   static void * runner_thread(void * obj);
-  RingBuffer<NewQuery> queue;
+  BatchQueue * batches;
+  BatchPool * pool;  // where finished batches are returned
+  unsigned int worker;  // index of own deque in batches
   uint64_t n_queries;
+  uint64_t n_partial;  // reads that ran out of work budget
+  uint64_t n_allocations;  // counted with -DCOUNT_ALLOCATIONS
+  uint64_t n_counted;  // reads mapped while counting
  private:
   void run();
   Aligner read1;
@@ -202,24 +280,26 @@ class Pairs : public PairsArgs {
  public:
   Pairs(const PairsArgs & args, const longSA & sa);
   ~Pairs();
-  Pair * get_pair();
-  void switch_pair(Pair * & pair);
-  void release_pair(Pair * pair);
+  QueryBatch * new_batch();
+  void publish(QueryBatch * batch);
   void done();
  private:
   const time_t start_time;
   std::vector<pthread_t> thread_ids;
+  std::vector<QueryBatch> pool_batches;
+  BatchPool pool;
+  BatchQueue batches;
   std::vector<Pair> pairs;
-  RingBuffer<Pair *> available;
   Pairs(const Pairs & disabled_copy_constructor);
   Pairs & operator=(const Pairs & disabled_assignment_operator);
 };
 
 class ReaderArgs {
  public:
-  ReaderArgs() : query_input(nullptr), fastq(false),
+  ReaderArgs() : query_input(nullptr), mate_input(nullptr), fastq(false),
                  sam_in(false), verbose(false) {}
   const char * query_input;
+  const char * mate_input;  // second of paired fastq files
   bool fastq;
   bool sam_in;
   bool verbose;
@@ -238,9 +318,19 @@ class QueryReader : public ReaderArgs {
   void print_sam_header();
   uint64_t n_sequences;
  private:
+  void get_query(QueryBatch * & batch, NewQuery * & query);
+  void read_single(LineReader & data, QueryBatch * & batch);
+  bool read_mate(LineReader & data, NewQuery & query, const bool second);
+  void read_paired(LineReader & data, LineReader & mates,
+                   QueryBatch * & batch);
   static void * fasta_thread(void * obj);
   Pairs & pairs;
-  uint64_t n_full;
+  double parse_seconds;  // not counting waits for batches
+  double run_seconds;
+  uint64_t input_bytes;  // after any decompression
+  uint64_t file_bytes;
+  bool gzip_input;
+  uint64_t n_skipped;  // read pairs
   pthread_attr_t attr;
   pthread_t thread_id;
   QueryReader & operator=(const QueryReader & disabled_assignment_operator);
@@ -248,9 +338,12 @@ class QueryReader : public ReaderArgs {
 
 class ReadersArgs : public ReaderArgs {
  public:
-  ReadersArgs() : n_input(0), input(nullptr) {}
+  ReadersArgs() : n_input(0), input(nullptr),
+                  fastq1(nullptr), fastq2(nullptr) {}
   unsigned int n_input;
   char * * input;
+  const char * fastq1;  // paired fastq files, read in lockstep
+  const char * fastq2;
  private:
   ReadersArgs & operator=(const ReadersArgs & disabled_assignment_operator);
 };
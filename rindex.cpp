@@ -0,0 +1,252 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#include "./rindex.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+using std::min;
+using std::upper_bound;
+
+#include <string>
+using std::string;
+
+#include <vector>
+using std::vector;
+
+#include "./longSA.h"
+#include "./query.h"
+#include "./util.h"
+#include "./error.h"
+using paa::Error;
+
+RIndex::~RIndex() {
+  if (memory_mapped && using_mapping) {
+    munmap(starts, n_runs * sizeof(ANINT));
+    munmap(cums, n_runs * sizeof(ANINT));
+    munmap(sa_ends, n_runs * sizeof(ANINT));
+    munmap(buckets, n_buckets * sizeof(ANINT));
+  } else {
+    free(starts);
+    free(cums);
+    free(sa_ends);
+    free(buckets);
+  }
+}
+
+void RIndex::build(const Sequence & ref, const ANINT * SA) {
+  N = ref.N;
+  root_toe = SA[N - 1];
+
+  // Character counts in text
+  for (unsigned int c = 0; c != 256; ++c) counts[c] = 0;
+  for (uint64_t i = 0; i != N; ++i)
+    ++counts[static_cast<unsigned char>(ref[i])];
+  uint64_t total = 0;
+  for (unsigned int c = 0; c != 256; ++c) {
+    C[c] = total;
+    total += counts[c];
+  }
+
+  // BWT[i] is the text character before suffix SA[i].  The suffix at
+  // the start of the text has none, stored as -1 and in no run.
+  vector<uint64_t> n_char_runs(256, 0);
+  int last = -1;
+  for (uint64_t i = 0; i != N; ++i) {
+    const int c = SA[i] ? static_cast<unsigned char>(ref[SA[i] - 1]) : -1;
+    if (c != last && c != -1) ++n_char_runs[c];
+    last = c;
+  }
+  char_begin[0] = 0;
+  for (unsigned int c = 0; c != 256; ++c)
+    char_begin[c + 1] = char_begin[c] + n_char_runs[c];
+  n_runs = char_begin[256];
+
+  if ((starts = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * n_runs))) == nullptr)
+    throw Error("starts malloc error");
+  if ((cums = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * n_runs))) == nullptr)
+    throw Error("cums malloc error");
+  if ((sa_ends = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * n_runs))) == nullptr)
+    throw Error("sa_ends malloc error");
+
+  vector<uint64_t> next_run(char_begin, char_begin + 256);
+  for (unsigned int c = 0; c != 256; ++c) counts[c] = 0;
+  uint64_t run = 0;
+  last = -1;
+  for (uint64_t i = 0; i != N; ++i) {
+    const int c = SA[i] ? static_cast<unsigned char>(ref[SA[i] - 1]) : -1;
+    if (c != -1) {
+      if (c != last) {
+        run = next_run[c]++;
+        starts[run] = i;
+        cums[run] = counts[c];
+      }
+      ++counts[c];
+      sa_ends[run] = SA[i];
+    }
+    last = c;
+  }
+
+  // About one bucket per run, so rank searches only a few runs
+  bucket_begin[0] = 0;
+  for (unsigned int c = 0; c != 256; ++c) {
+    const uint64_t n_char = n_char_runs[c];
+    bucket_shift[c] = 0;
+    while (n_char && (N >> bucket_shift[c]) > n_char) ++bucket_shift[c];
+    bucket_begin[c + 1] = bucket_begin[c] +
+        (n_char ? (N >> bucket_shift[c]) + 2 : 0);
+  }
+  n_buckets = bucket_begin[256];
+  if ((buckets = reinterpret_cast<ANINT *>(
+          malloc(sizeof(ANINT) * n_buckets))) == nullptr)
+    throw Error("buckets malloc error");
+  for (unsigned int c = 0; c != 256; ++c) {
+    uint64_t r = char_begin[c];
+    for (uint64_t b = 0; b != bucket_begin[c + 1] - bucket_begin[c]; ++b) {
+      while (r != char_begin[c + 1] && starts[r] < (b << bucket_shift[c])) ++r;
+      buckets[bucket_begin[c] + b] = r;
+    }
+  }
+}
+
+void RIndex::load(const string & base, FILE * index) {
+  bread(index, N, "N");
+  bread(index, n_runs, "n_runs");
+  bread(index, root_toe, "root_toe");
+  bread(index, C[0], "C", 256);
+  bread(index, counts[0], "counts", 256);
+  bread(index, char_begin[0], "char_begin", 257);
+  bread(index, n_buckets, "n_buckets");
+  bread(index, bucket_shift[0], "bucket_shift", 256);
+  bread(index, bucket_begin[0], "bucket_begin", 257);
+  using_mapping = true;
+  bread(base + ".rindex.starts.bin", starts, "starts", n_runs);
+  bread(base + ".rindex.cums.bin", cums, "cums", n_runs);
+  bread(base + ".rindex.ends.bin", sa_ends, "sa_ends", n_runs);
+  bread(base + ".rindex.buckets.bin", buckets, "buckets", n_buckets);
+}
+
+void RIndex::save(const string & base, FILE * index) const {
+  bwrite(index, N, "N");
+  bwrite(index, n_runs, "n_runs");
+  bwrite(index, root_toe, "root_toe");
+  bwrite(index, C[0], "C", 256);
+  bwrite(index, counts[0], "counts", 256);
+  bwrite(index, char_begin[0], "char_begin", 257);
+  bwrite(index, n_buckets, "n_buckets");
+  bwrite(index, bucket_shift[0], "bucket_shift", 256);
+  bwrite(index, bucket_begin[0], "bucket_begin", 257);
+  bwrite(base + ".rindex.starts.bin", starts[0], "starts", n_runs);
+  bwrite(base + ".rindex.cums.bin", cums[0], "cums", n_runs);
+  bwrite(base + ".rindex.ends.bin", sa_ends[0], "sa_ends", n_runs);
+  bwrite(base + ".rindex.buckets.bin", buckets[0], "buckets", n_buckets);
+}
+
+uint64_t RIndex::rank(const unsigned char c, const uint64_t i,
+                      uint64_t & run) const {
+  const ANINT * const begin = starts + char_begin[c];
+  if (i == 0 || begin == starts + char_begin[c + 1]) {
+    run = char_begin[c + 1];
+    return 0;
+  }
+  const ANINT * const bucket =
+      buckets + bucket_begin[c] + ((i - 1) >> bucket_shift[c]);
+  const ANINT * const after = upper_bound(starts + bucket[0],
+                                          starts + bucket[1],
+                                          static_cast<ANINT>(i - 1));
+  if (after == begin) {
+    run = char_begin[c + 1];
+    return 0;
+  }
+  run = after - starts - 1;
+  const uint64_t run_end = run + 1 == char_begin[c + 1] ?
+      counts[c] : cums[run + 1];
+  return min(cums[run] + (i - starts[run]), run_end);
+}
+
+// Toehold lemma: the last c in [start, end) is either at end - 1, whose
+// suffix position is known, or at the end of a run of c, which is sampled.
+bool RIndex::extend(const char c, bw_interval & interval,
+                    uint64_t & work) const {
+  ++work;
+  const unsigned char u = c;
+  if (char_begin[u] == char_begin[u + 1]) return false;
+  uint64_t run;
+  const uint64_t rank_start = rank(u, interval.start, run);
+  const uint64_t rank_end = rank(u, interval.end, run);
+  if (rank_start == rank_end) return false;
+  const uint64_t run_length = (run + 1 == char_begin[u + 1] ?
+                               counts[u] : cums[run + 1]) - cums[run];
+  if (starts[run] + run_length >= interval.end)
+    interval.toe = interval.toe - 1;
+  else
+    interval.toe = sa_ends[run] - 1;
+  interval.start = C[u] + rank_start;
+  interval.end = C[u] + rank_end;
+  return true;
+}
+
+uint64_t RIndex::last_repeated_end(const string & P, const uint64_t start,
+                                   const uint64_t end, uint64_t & work) const {
+  uint64_t repeated = start;
+  uint64_t unique = end;
+  while (unique - repeated > 1) {
+    const uint64_t mid = (repeated + unique) / 2;
+    bw_interval cur = root();
+    uint64_t k = mid;
+    while (k != start && cur.size() > 1 && extend(P[k - 1], cur, work)) --k;
+    if (cur.size() > 1)
+      repeated = mid;
+    else
+      unique = mid;
+  }
+  return repeated;
+}
+
+// Backward search works from the right, so matches are found by their
+// end in the query.  The longest match ending at end is a MAM if it is
+// unique, long enough and right maximal (left maximality is implied).
+// Once unique, a match is extended directly against the reference.
+// Ends whose longest match is just a shorter piece of the same unique
+// occurrence are skipped by finding the last end at which the match
+// start no longer gives a unique string.
+void RIndex::MAM(Aligner & query, const Sequence & ref) const {
+  const string & P = query();
+  const uint64_t m = P.length();
+  vector<match_t> & found = query.scratch_matches();
+  uint64_t end = m;
+  while (end && !query.out_of_budget()) {
+    bw_interval cur = root();
+    uint64_t start = end;
+    while (start && cur.size() > 1 && extend(P[start - 1], cur, query.work))
+      --start;
+    if (start == end) {
+      --end;
+      continue;
+    }
+    if (cur.size() > 1) {
+      // Repeated back to the query start means every shorter end repeats
+      if (start == 0) break;
+      --end;
+      continue;
+    }
+    uint64_t pos = cur.toe;
+    while (start && pos && P[start - 1] == ref[pos - 1]) {
+      --start;
+      --pos;
+    }
+    const uint64_t len = end - start;
+    if (len >= query.min_len &&
+        (end == m || pos + len >= N || P[end] != ref[pos + len]))
+      found.push_back(match_t(pos, start, len));
+    end = last_repeated_end(P, start, end, query.work);
+  }
+  // Report in query order, like longSA::MAM
+  for (vector<match_t>::const_reverse_iterator match = found.rbegin();
+       match != found.rend(); ++match)
+    query.process_match(*match);
+}
@@ -0,0 +1,87 @@
+/* Copyright Peter Andrews 2013 CSHL */
+
+#ifndef LONGMEM_RINDEX_H_
+#define LONGMEM_RINDEX_H_
+
+#include <stdio.h>
+
+#include <string>
+
+#include "./size.h"
+#include "./fasta.h"
+
+class Aligner;
+
+// Backward search interval [start, end) in suffix array order, with
+// the text position of the suffix at end - 1 (the toehold).
+struct bw_interval {
+  bw_interval(const uint64_t s, const uint64_t e, const uint64_t t)
+      : start(s), end(e), toe(t) {}
+  uint64_t size() const { return end - start; }
+  uint64_t start, end, toe;
+};
+
+// Run-length encoded BWT with suffix array samples at the end of each
+// run (an r-index).  Runs are grouped by character and sorted by start,
+// so that rank of a character is a binary search among its runs, narrowed
+// by a bucket table holding about one entry per run.
+// Memory is proportional to the number of runs, not the text length.
+class RIndex {
+ public:
+  RIndex() : N(0), n_runs(0), n_buckets(0), starts(nullptr), cums(nullptr),
+             sa_ends(nullptr), buckets(nullptr), using_mapping(false) {}
+  ~RIndex();
+
+  bool empty() const { return n_runs == 0; }
+  uint64_t runs() const { return n_runs; }
+  uint64_t bytes() const { return (n_runs * 3 + n_buckets) * sizeof(ANINT); }
+  const ANINT * run_starts() const { return starts; }
+  const ANINT * run_cums() const { return cums; }
+  const ANINT * run_sa_ends() const { return sa_ends; }
+  const ANINT * bucket_data() const { return buckets; }
+  uint64_t run_bytes() const { return n_runs * sizeof(ANINT); }
+  uint64_t bucket_bytes() const { return n_buckets * sizeof(ANINT); }
+
+  // Interval of the empty pattern
+  bw_interval root() const { return bw_interval(0, N, root_toe); }
+
+  // Prepend c to the pattern of interval.  Returns false and leaves
+  // interval unchanged if the longer pattern does not occur.  Each call
+  // is added to work.
+  bool extend(const char c, bw_interval & interval, uint64_t & work) const;
+
+  // Build from the text and its suffix array.
+  void build(const Sequence & ref, const ANINT * SA);
+  void load(const std::string & base, FILE * index);
+  void save(const std::string & base, FILE * index) const;
+
+  // Maximal almost-unique matches, as in longSA::MAM.
+  void MAM(Aligner & query, const Sequence & ref) const;
+
+ private:
+  // Number of c in BWT[0, i), and the last run of c starting before i
+  uint64_t rank(const unsigned char c, const uint64_t i,
+                uint64_t & run) const;
+  // Largest end in [start, end) such that P[start, end) is repeated
+  uint64_t last_repeated_end(const std::string & P, const uint64_t start,
+                             const uint64_t end, uint64_t & work) const;
+
+  uint64_t N;
+  uint64_t n_runs;
+  uint64_t n_buckets;
+  uint64_t root_toe;  // SA[N - 1]
+  uint64_t C[256];  // number of text characters less than c
+  uint64_t counts[256];  // number of c in BWT
+  uint64_t char_begin[257];  // first run of c in the run arrays
+  uint64_t bucket_shift[256];  // BWT position to bucket shift for c
+  uint64_t bucket_begin[257];  // first bucket of c
+  ANINT * starts;  // BWT position of run start
+  ANINT * cums;  // number of c in BWT before run start
+  ANINT * sa_ends;  // SA value at the last position of run
+  ANINT * buckets;  // first run of c starting in each bucket of positions
+  bool using_mapping;
+  RIndex(const RIndex & disabled_copy_constructor);
+  RIndex & operator=(const RIndex & disabled_assignment_operator);
+};
+
+#endif  // LONGMEM_RINDEX_H_
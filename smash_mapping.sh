@@ -16,7 +16,12 @@ reads_1_gz="$2"
 reads_2_gz="$3"
 
 # map input data fastq.gz -> sam parts
-$SMASH_CODE/mummer -verbose -rcref -qthreads 12 -nomap -samin -samout $SMASH_REF  <($SMASH_CODE/fastqs_to_sam <(zcat $reads_1_gz) <(zcat $reads_2_gz) 1)
+# (concatenated gzip files are read as multi-member gzip, and -n keeps
+# N bases from matching, as fastqs_to_sam replaceN did by making them Z.
+# Unlike replaceN, SEQ keeps its N bases, and other IUPAC codes no longer
+# match either.  Only QNAME, FLAG, RNAME, POS and CIGAR are read below,
+# by the perl name edit and mappability_tag, so neither change matters)
+$SMASH_CODE/mummer -verbose -rcref -qthreads 12 -nomap -samout -n $SMASH_REF -fq1 <(cat $reads_1_gz) -fq2 <(cat $reads_2_gz)
 mv mapout $id.mapout
 
 # sam parts -> mappability tagged sam -> namesorted bam
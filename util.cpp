@@ -2,29 +2,60 @@
 
 #include "./util.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <zlib.h>
+
+#include <chrono>
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+#include <condition_variable>
+using std::condition_variable;
+
+#include <deque>
+using std::deque;
+
+#include <exception>
+using std::exception_ptr;
 
 #include <iostream>
 using std::cerr;
 using std::endl;
 
+#include <map>
+using std::map;
+
+#include <mutex>
+using std::mutex;
+using std::unique_lock;
+
 #include <sstream>
 using std::stringstream;
 
 #include <string>
 using std::string;
 
+#include <vector>
+using std::vector;
+
 #include "./error.h"
 using paa::Error;
 
 bool read_ahead = true;
 bool memory_mapped = true;
+unsigned int load_threads = 16;
+bool direct_io = false;
+uint64_t loaded_bytes = 0;
+double load_seconds = 0;
 
 void remove(string & input, const string & search) {
   const size_t pos = input.find(search);
@@ -97,6 +128,55 @@ void breadc(FILE * input, void * data, const std::string & name,
     throw Error("problem reading") << count << "elements at" << name;
 }
 
+// Chunks are claimed in order by load_threads threads.  O_DIRECT needs
+// aligned memory, offsets and lengths, so the buffer is rounded up to
+// whole chunks, reads are of whole aligned blocks, and the file is read
+// normally if O_DIRECT is refused.
+static void pread_parallel(const std::string & filename, void * & data,
+                           const std::string & name,
+                           const uint64_t count) {
+  const steady_clock::time_point start = steady_clock::now();
+  const uint64_t alignment = 4096;
+  const uint64_t chunk = 8 << 20;
+  const uint64_t n_chunks = (count + chunk - 1) / chunk;
+  if (posix_memalign(&data, alignment, std::max(n_chunks * chunk, alignment)))
+    throw Error("malloc error for") << name;
+  int input = -1;
+#ifdef O_DIRECT
+  if (direct_io) input = open(filename.c_str(), O_RDONLY | O_DIRECT);
+#endif
+  if (input == -1) input = open(filename.c_str(), O_RDONLY);
+  if (input == -1)
+    throw Error("could not open input") << filename << "for reading";
+  try {
+    run_tasks(n_chunks, load_threads, [&](const uint64_t c) {
+        const uint64_t offset = c * chunk;
+        const uint64_t wanted = std::min(chunk, count - offset);
+        uint64_t done = 0;
+        while (done < wanted) {
+          // Whole aligned blocks, which the buffer has room for
+          const uint64_t request =
+              (wanted - done + alignment - 1) / alignment * alignment;
+          const ssize_t got = pread(
+              input, reinterpret_cast<char *>(data) + offset + done,
+              request, offset + done);
+          if (got <= 0)
+            throw Error("problem reading") << count << "bytes at" << name;
+          done += got;
+          // After a short read, retry from an aligned offset
+          if (done < wanted) done = done / alignment * alignment;
+        }
+      });
+  } catch (...) {
+    close(input);
+    throw;
+  }
+  if (close(input) == -1)
+    throw Error("problem closing input file") << filename;
+  loaded_bytes += count;
+  load_seconds += duration<double>(steady_clock::now() - start).count();
+}
+
 void breadc(const std::string & filename, void * & data,
             const std::string & name,
             const uint64_t count) {
@@ -115,13 +195,553 @@ void breadc(const std::string & filename, void * & data,
     if (close(input) == -1)
       throw Error("problem closing input file") << filename;
   } else {
-    FILE * input = fopen(filename.c_str(), "rb");
-    if ((data = malloc(count)) == nullptr)
-      throw Error("malloc error for") << name;
-    breadc(input, data, name, count);
-    if (fclose(input) != 0)
-      throw Error("problem closing input file") << filename;
+    pread_parallel(filename, data, name, count);
+  }
+}
+
+static const steady_clock::time_point program_start = steady_clock::now();
+
+double seconds_since_start() {
+  return duration<double>(steady_clock::now() - program_start).count();
+}
+
+void page_faults(uint64_t & major, uint64_t & minor) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    throw Error("could not get resource usage");
+  major = usage.ru_majflt;
+  minor = usage.ru_minflt;
+}
+
+static const char * page_start(const void * data) {
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  return reinterpret_cast<const char *>(
+      reinterpret_cast<uintptr_t>(data) / page * page);
+}
+
+uint64_t resident_bytes(const void * data, const uint64_t bytes) {
+  if (data == nullptr || bytes == 0) return 0;
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  const char * const start = page_start(data);
+  const uint64_t length = reinterpret_cast<const char *>(data) + bytes - start;
+  vector<unsigned char> pages((length + page - 1) / page);
+  if (mincore(const_cast<char *>(start), length, &pages[0]))
+    throw Error("mincore failed");
+  uint64_t resident = 0;
+  for (const unsigned char in_core : pages) if (in_core & 1) resident += page;
+  return std::min(resident, bytes);
+}
+
+ThreadPool::ThreadPool(const unsigned int n_threads_) :
+    n_threads(0), n_tasks(0), next_task(0), n_running(0), busy(false),
+    stopping(false) {
+  if (pthread_mutex_init(&mutex, nullptr))
+    throw Error("thread pool mutex init error");
+  if (pthread_cond_init(&ready, nullptr))
+    throw Error("thread pool ready cond init error");
+  if (pthread_cond_init(&done, nullptr))
+    throw Error("thread pool done cond init error");
+  thread_ids.resize(std::max(n_threads_, 1U));
+  for (; n_threads != thread_ids.size(); ++n_threads) {
+    if (pthread_create(&thread_ids[n_threads], nullptr,
+                       &ThreadPool::worker_thread, this)) {
+      stop();
+      throw Error("Problem creating pool thread") << n_threads;
+    }
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  stop();
+}
+
+void ThreadPool::stop() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&mutex);
+  for (unsigned int t = 0; t != n_threads; ++t)
+    pthread_join(thread_ids[t], nullptr);
+  pthread_cond_destroy(&done);
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+void ThreadPool::start(const uint64_t n_tasks_,
+                       const std::function<void(uint64_t)> & task_) {
+  pthread_mutex_lock(&mutex);
+  while (busy) pthread_cond_wait(&done, &mutex);
+  busy = true;
+  task = task_;
+  n_tasks = n_tasks_;
+  next_task = 0;
+  error = nullptr;
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::wait() {
+  pthread_mutex_lock(&mutex);
+  while (next_task != n_tasks || n_running) pthread_cond_wait(&done, &mutex);
+  const exception_ptr batch_error = error;
+  error = nullptr;
+  busy = false;
+  pthread_cond_broadcast(&done);
+  pthread_mutex_unlock(&mutex);
+  if (batch_error) std::rethrow_exception(batch_error);
+}
+
+void * ThreadPool::worker_thread(void * obj) {
+  reinterpret_cast<ThreadPool *>(obj)->work();
+  return nullptr;
+}
+
+void ThreadPool::work() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    while (!stopping && next_task == n_tasks)
+      pthread_cond_wait(&ready, &mutex);
+    if (next_task == n_tasks) break;
+    const uint64_t t = next_task++;
+    ++n_running;
+    pthread_mutex_unlock(&mutex);
+    exception_ptr task_error;
+    try {
+      task(t);
+    } catch (...) {
+      task_error = std::current_exception();
+    }
+    pthread_mutex_lock(&mutex);
+    if (task_error) {
+      if (!error) error = task_error;
+      next_task = n_tasks;
+    }
+    if (--n_running == 0 && next_task == n_tasks)
+      pthread_cond_broadcast(&done);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void run_tasks(const uint64_t n_tasks, const unsigned int n_threads,
+               const std::function<void(uint64_t)> & task) {
+  if (n_tasks == 0) return;
+  ThreadPool pool(static_cast<unsigned int>(
+      std::min<uint64_t>(std::max(n_threads, 1U), n_tasks)));
+  pool.run(n_tasks, task);
+}
+
+unsigned int n_cores() {
+  const int64_t n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? static_cast<unsigned int>(n) : 1;
+}
+
+// Reads one byte per page, in 16 MB chunks claimed in order by threads
+void touch_pages(const void * data, const uint64_t bytes,
+                 const unsigned int n_threads) {
+  if (data == nullptr || bytes == 0) return;
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  const uint64_t chunk = 16 << 20;
+  const uint64_t n_chunks = (bytes + chunk - 1) / chunk;
+  const volatile char * const start =
+      reinterpret_cast<const volatile char *>(data);
+  run_tasks(n_chunks, n_threads, [&](const uint64_t c) {
+      const uint64_t end = std::min(bytes, (c + 1) * chunk);
+      for (uint64_t b = c * chunk; b < end; b += page) start[b];
+    });
+}
+
+// Gzip input is inflated by one thread, since member boundaries are
+// only found by inflating.  BGZF members give their compressed size in
+// a header field, so a splitter task groups them into jobs that are
+// inflated by a task per core.  Each stream runs its tasks on a thread
+// pool of its own, as they wait on each other.  Output chunks are
+// numbered and handed to the reader in order, with at most max_ahead
+// chunks waiting.
+class InflateStream {
+ public:
+  InflateStream(const int input_, const string & file_name_,
+                const char * start, const uint64_t start_size) :
+      input(input_), file_name(file_name_), pending(start, start + start_size),
+      n_compressed(start_size), next_chunk(0), end_chunk(0),
+      finished(false), stopping(false), n_jobs(0), jobs_done(false),
+      chunk_pos(0), pool(bgzf(pending) ? n_cores() + 1 : 1) {
+    // Task 0 splits or inflates the input, the rest inflate BGZF jobs
+    max_ahead = 2 * n_cores() + 2;
+    const bool split = pool.size() > 1;
+    pool.start(pool.size(), [this, split](const uint64_t t) {
+        guard(t ? &InflateStream::inflate_jobs : split ?
+              &InflateStream::split_blocks : &InflateStream::inflate_stream);
+      });
+  }
+  ~InflateStream() {
+    {
+      unique_lock<mutex> lock(access);
+      stopping = true;
+    }
+    changed.notify_all();
+    pool.wait();  // guard keeps task errors for read, so nothing is thrown
+  }
+
+  // Decompressed bytes, or 0 at end
+  uint64_t read(char * out, const uint64_t size) {
+    while (chunk_pos == chunk.size()) {
+      unique_lock<mutex> lock(access);
+      while (!error && !ready.count(next_chunk) &&
+             !(finished && next_chunk == end_chunk)) changed.wait(lock);
+      if (error) std::rethrow_exception(error);
+      if (!ready.count(next_chunk)) return 0;
+      chunk.swap(ready[next_chunk]);
+      ready.erase(next_chunk++);
+      chunk_pos = 0;
+      lock.unlock();
+      changed.notify_all();
+    }
+    const uint64_t n = std::min(size, chunk.size() - chunk_pos);
+    memcpy(out, chunk.data() + chunk_pos, n);
+    chunk_pos += n;
+    return n;
+  }
+  uint64_t compressed_bytes() const { return n_compressed; }
+
+ private:
+  typedef vector<char> Chunk;
+  struct Job {
+    uint64_t index;
+    uint64_t out_size;
+    Chunk data;  // whole BGZF members
+  };
+  static const uint64_t chunk_size = 4 << 20;
+  static const uint64_t members_per_job = 64;  // about 4 MB inflated
+
+  static bool bgzf(const Chunk & data) {
+    return data.size() >= 18 &&
+        static_cast<unsigned char>(data[3]) == 4 &&  // FEXTRA only
+        data[12] == 'B' && data[13] == 'C';
+  }
+
+  // For gzip members
+  void init_inflate(z_stream & stream) const {
+    stream.zalloc = nullptr;
+    stream.zfree = nullptr;
+    stream.opaque = nullptr;
+    stream.avail_in = 0;
+    stream.next_in = nullptr;
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+      throw Error("inflate init error for") << file_name;
+  }
+
+  void guard(void (InflateStream::*task)()) {
+    try {
+      (this->*task)();
+    } catch (...) {
+      {
+        unique_lock<mutex> lock(access);
+        if (!error) error = std::current_exception();
+      }
+      changed.notify_all();
+    }
+  }
+
+  // Compressed input, or 0 at end
+  uint64_t read_compressed(char * data, const uint64_t size) {
+    if (pending.size()) {
+      const uint64_t n = std::min(size, pending.size());
+      memcpy(data, pending.data(), n);
+      pending.erase(pending.begin(), pending.begin() + n);
+      return n;
+    }
+    ssize_t n_read;
+    while ((n_read = ::read(input, data, size)) == -1 && errno == EINTR)
+      continue;
+    if (n_read == -1) throw Error("problem reading") << file_name;
+    n_compressed += n_read;
+    return n_read;
+  }
+
+  // Returns false if stopping
+  bool deliver(const uint64_t index, Chunk & data) {
+    unique_lock<mutex> lock(access);
+    while (index >= next_chunk + max_ahead && !stopping && !error)
+      changed.wait(lock);
+    if (stopping || error) return false;
+    ready[index].swap(data);
+    lock.unlock();
+    changed.notify_all();
+    return true;
+  }
+  void finish(const uint64_t n_chunks) {
+    {
+      unique_lock<mutex> lock(access);
+      end_chunk = n_chunks;
+      finished = true;
+    }
+    changed.notify_all();
+  }
+
+  void inflate_stream() {
+    z_stream stream;
+    init_inflate(stream);
+    Chunk in(chunk_size);
+    Chunk out(chunk_size);
+    uint64_t index = 0;
+    bool in_member = false;
+    stream.next_out = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = out.size();
+    while (true) {
+      if (stream.avail_in == 0) {
+        const uint64_t n_read = read_compressed(in.data(), in.size());
+        if (n_read == 0) break;
+        stream.next_in = reinterpret_cast<Bytef *>(in.data());
+        stream.avail_in = n_read;
+      }
+      const int status = inflate(&stream, Z_NO_FLUSH);
+      if (status == Z_STREAM_END) {  // another member may follow
+        in_member = false;
+        inflateReset(&stream);
+      } else if (status == Z_OK || status == Z_BUF_ERROR) {
+        in_member = true;
+      } else {
+        inflateEnd(&stream);
+        throw Error("gzip inflate error in") << file_name;
+      }
+      if (stream.avail_out == 0) {
+        if (!deliver(index++, out)) break;
+        out.resize(chunk_size);
+        stream.next_out = reinterpret_cast<Bytef *>(out.data());
+        stream.avail_out = out.size();
+      }
+    }
+    inflateEnd(&stream);
+    if (in_member) {
+      unique_lock<mutex> lock(access);
+      if (!stopping) throw Error("truncated gzip input") << file_name;
+    }
+    out.resize(out.size() - stream.avail_out);
+    if (deliver(index, out)) finish(index + 1);
+  }
+
+  // Make at least n bytes available after pos, returning false at end
+  bool need(Chunk & data, uint64_t & pos, uint64_t & end, const uint64_t n) {
+    if (end - pos >= n) return true;
+    memmove(data.data(), data.data() + pos, end - pos);
+    end -= pos;
+    pos = 0;
+    if (data.size() < n) data.resize(n);
+    while (end < n) {
+      const uint64_t n_read =
+          read_compressed(data.data() + end, data.size() - end);
+      if (n_read == 0) return false;
+      end += n_read;
+    }
+    return true;
+  }
+
+  void split_blocks() {
+    Chunk data(chunk_size);
+    uint64_t pos = 0;
+    uint64_t end = 0;
+    Job job{0, 0, Chunk()};
+    uint64_t n_members = 0;
+    while (need(data, pos, end, 18)) {
+      const unsigned char * const header =
+          reinterpret_cast<const unsigned char *>(data.data() + pos);
+      if (header[0] != 31 || header[1] != 139 || header[3] != 4 ||
+          header[12] != 'B' || header[13] != 'C')
+        throw Error("bad BGZF block header in") << file_name;
+      const uint64_t block_size = (header[16] | (header[17] << 8)) + 1;
+      if (!need(data, pos, end, block_size))
+        throw Error("truncated BGZF input") << file_name;
+      const unsigned char * const block =
+          reinterpret_cast<const unsigned char *>(data.data() + pos);
+      job.out_size += block[block_size - 4] | (block[block_size - 3] << 8) |
+          (block[block_size - 2] << 16) |
+          (static_cast<uint64_t>(block[block_size - 1]) << 24);
+      job.data.insert(job.data.end(), data.data() + pos,
+                      data.data() + pos + block_size);
+      pos += block_size;
+      if (++n_members == members_per_job) {
+        if (!submit(job)) return;
+        n_members = 0;
+      }
+    }
+    if (end != pos) throw Error("truncated BGZF input") << file_name;
+    if (n_members && !submit(job)) return;
+    {
+      unique_lock<mutex> lock(access);
+      jobs_done = true;
+    }
+    changed.notify_all();
+  }
+
+  // Returns false if stopping
+  bool submit(Job & job) {
+    unique_lock<mutex> lock(access);
+    while (jobs.size() >= max_ahead && !stopping && !error) changed.wait(lock);
+    if (stopping || error) return false;
+    jobs.push_back(Job{n_jobs++, job.out_size, Chunk()});
+    jobs.back().data.swap(job.data);
+    job.out_size = 0;
+    lock.unlock();
+    changed.notify_all();
+    return true;
+  }
+
+  void inflate_jobs() {
+    z_stream stream;
+    init_inflate(stream);
+    Job job;
+    while (true) {
+      {
+        unique_lock<mutex> lock(access);
+        while (jobs.empty() && !jobs_done && !stopping && !error)
+          changed.wait(lock);
+        if (jobs.empty() || stopping || error) {
+          const bool last = jobs_done && jobs.empty() && !stopping && !error;
+          lock.unlock();
+          inflateEnd(&stream);
+          if (last) {
+            // Any thread may see the end, so all report the same count
+            finish(n_jobs);
+          }
+          return;
+        }
+        job.index = jobs.front().index;
+        job.out_size = jobs.front().out_size;
+        job.data.swap(jobs.front().data);
+        jobs.pop_front();
+      }
+      changed.notify_all();
+      // A job of only empty members, like the EOF marker, still needs a
+      // valid output pointer for zlib
+      Chunk out(std::max<uint64_t>(job.out_size, 1));
+      stream.next_in = reinterpret_cast<Bytef *>(job.data.data());
+      stream.avail_in = job.data.size();
+      stream.next_out = reinterpret_cast<Bytef *>(out.data());
+      stream.avail_out = out.size();
+      while (stream.avail_in) {
+        const int status = inflate(&stream, Z_FINISH);
+        if (status != Z_STREAM_END) {
+          inflateEnd(&stream);
+          throw Error("BGZF inflate error in") << file_name;
+        }
+        inflateReset(&stream);
+      }
+      if (out.size() - stream.avail_out != job.out_size) {
+        inflateEnd(&stream);
+        throw Error("BGZF size mismatch in") << file_name;
+      }
+      out.resize(job.out_size);
+      if (!deliver(job.index, out)) {
+        inflateEnd(&stream);
+        return;
+      }
+    }
+  }
+
+  const int input;
+  const string file_name;
+  Chunk pending;  // read before decompression was known to be needed
+  uint64_t n_compressed;
+  uint64_t max_ahead;
+  mutex access;
+  condition_variable changed;
+  map<uint64_t, Chunk> ready;  // inflated chunks waiting to be read
+  uint64_t next_chunk;  // to be read
+  uint64_t end_chunk;  // number of chunks, once finished
+  bool finished;
+  bool stopping;
+  exception_ptr error;
+  deque<Job> jobs;  // BGZF members waiting to be inflated
+  uint64_t n_jobs;
+  bool jobs_done;
+  Chunk chunk;  // being read
+  uint64_t chunk_pos;
+  ThreadPool pool;
+};
+const uint64_t InflateStream::chunk_size;
+const uint64_t InflateStream::members_per_job;
+
+LineReader::LineReader(const string & file_name_, const uint64_t block_size)
+    : file_name(file_name_), input(open(file_name.c_str(), O_RDONLY)),
+      capacity(block_size),
+      buffer(static_cast<char *>(malloc(capacity))),
+      begin(buffer), end(buffer), at_eof(false), n_bytes(0),
+      n_file_bytes(0), inflater(nullptr) {
+  if (input == -1) throw Error("unable to open") << file_name;
+  if (buffer == nullptr) throw Error("line buffer malloc error");
+}
+
+LineReader::~LineReader() {
+  delete inflater;
+  close(input);
+  free(buffer);
+}
+
+uint64_t LineReader::file_bytes() const {
+  return inflater == nullptr ? n_file_bytes : inflater->compressed_bytes();
+}
+
+bool LineReader::next(const char * & line, uint64_t & length) {
+  while (true) {
+    const char * const newline = static_cast<const char *>(
+        memchr(begin, '\n', end - begin));
+    if (newline != nullptr) {
+      line = begin;
+      length = newline - begin;
+      begin += length + 1;
+      return true;
+    }
+    if (at_eof) {
+      if (begin == end) return false;
+      line = begin;
+      length = end - begin;
+      begin = end;
+      return true;
+    }
+    fill();
+  }
+}
+
+// Move the partial line to the buffer start, growing the buffer if the
+// line fills it, and read another block after it
+void LineReader::fill() {
+  const uint64_t partial = end - begin;
+  if (partial == capacity) {
+    capacity *= 2;
+    char * const larger = static_cast<char *>(realloc(buffer, capacity));
+    if (larger == nullptr) throw Error("line buffer realloc error");
+    buffer = larger;
+  } else {
+    memmove(buffer, begin, partial);
+  }
+  begin = buffer;
+  end = buffer + partial;
+  const uint64_t n_read = read_input(end, capacity - partial);
+  if (n_read == 0) at_eof = true;
+  end += n_read;
+  n_bytes += n_read;
+}
+
+// The first read checks for the gzip magic bytes
+uint64_t LineReader::read_input(char * data, const uint64_t size) {
+  if (inflater != nullptr) return inflater->read(data, size);
+  const bool first = n_file_bytes == 0;
+  uint64_t n_read = 0;
+  do {
+    ssize_t got;
+    while ((got = read(input, data + n_read, size - n_read)) == -1 &&
+           errno == EINTR) continue;
+    if (got == -1) throw Error("problem reading") << file_name;
+    if (got == 0) break;
+    n_read += got;
+  } while (first && n_read < 2);
+  n_file_bytes += n_read;
+  if (first && n_read >= 2 && static_cast<unsigned char>(data[0]) == 31 &&
+      static_cast<unsigned char>(data[1]) == 139) {
+    inflater = new InflateStream(input, file_name, data, n_read);
+    return inflater->read(data, size);
   }
+  return n_read;
 }
 
 MappedFile::MappedFile() {}
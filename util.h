@@ -3,15 +3,24 @@
 #ifndef LONGMEM_UTIL_H_
 #define LONGMEM_UTIL_H_
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include <exception>
+#include <functional>
 #include <sstream>
 #include <string>
 #include <fstream>
+#include <vector>
 
 extern bool read_ahead;
 extern bool memory_mapped;
+// Without memory mapping, files are read by load_threads threads with
+// many outstanding preads, optionally bypassing the page cache
+extern unsigned int load_threads;
+extern bool direct_io;
+extern uint64_t loaded_bytes;  // read so far, and time taken
+extern double load_seconds;
 
 template <class Val>
 Val sqr(const Val val) {
@@ -73,6 +82,58 @@ void bread(const std::string & filename, T * & data,
   breadc(filename, (void*&)data, name, count * sizeof(T));
 }
 
+// Pthreads that run task(i) for each i of a batch, each thread taking
+// the next unclaimed i.  One batch runs at a time: start waits for the
+// previous batch to be waited on.  wait rethrows the first exception a
+// task threw, after which the rest of the batch is skipped.
+class ThreadPool {
+ public:
+  explicit ThreadPool(const unsigned int n_threads_);
+  ~ThreadPool();
+  unsigned int size() const { return n_threads; }
+  void start(const uint64_t n_tasks_,
+             const std::function<void(uint64_t)> & task_);
+  void wait();
+  void run(const uint64_t n_tasks_,
+           const std::function<void(uint64_t)> & task_) {
+    start(n_tasks_, task_);
+    wait();
+  }
+
+ private:
+  static void * worker_thread(void * obj);
+  void work();
+  void stop();
+
+  unsigned int n_threads;
+  std::vector<pthread_t> thread_ids;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;  // a batch was started or the pool is stopping
+  pthread_cond_t done;  // the batch finished, or the pool became idle
+  std::function<void(uint64_t)> task;
+  uint64_t n_tasks;
+  uint64_t next_task;
+  unsigned int n_running;
+  bool busy;
+  bool stopping;
+  std::exception_ptr error;
+  ThreadPool(const ThreadPool & disabled_copy_constructor);
+  ThreadPool & operator=(const ThreadPool & disabled_assignment_operator);
+};
+
+// Runs task(i) for i in [0, n_tasks) on a pool of up to n_threads threads
+void run_tasks(const uint64_t n_tasks, const unsigned int n_threads,
+               const std::function<void(uint64_t)> & task);
+// Number of online processors, at least 1
+unsigned int n_cores();
+
+// Memory residency
+uint64_t resident_bytes(const void * data, const uint64_t bytes);  // mincore
+void touch_pages(const void * data, const uint64_t bytes,
+                 const unsigned int n_threads);
+double seconds_since_start();
+void page_faults(uint64_t & major, uint64_t & minor);
+
 class warn {
  public:
   explicit warn(const std::string & message);
@@ -124,6 +185,41 @@ class MappedFile {
   size_t page;
 };
 
+// Decompresses gzip input in background threads, defined in util.cpp
+class InflateStream;
+
+// Reads a file in large blocks and returns its lines as views into the
+// block, without copying.  A line is valid until the next call to next.
+// Gzip input, recognized by its magic bytes, is decompressed on the fly.
+class LineReader {
+ public:
+  explicit LineReader(const std::string & file_name_,
+                      const uint64_t block_size = 4 << 20);
+  ~LineReader();
+  // Line without its newline, or false at end of file
+  bool next(const char * & line, uint64_t & length);
+  uint64_t bytes() const { return n_bytes; }  // after any decompression
+  uint64_t file_bytes() const;  // read from the file
+  bool compressed() const { return inflater != nullptr; }
+  const std::string & name() const { return file_name; }
+
+ private:
+  void fill();
+  uint64_t read_input(char * data, const uint64_t size);
+  std::string file_name;
+  int input;
+  uint64_t capacity;
+  char * buffer;
+  char * begin;  // of unread data
+  char * end;  // of data in buffer
+  bool at_eof;
+  uint64_t n_bytes;
+  uint64_t n_file_bytes;
+  InflateStream * inflater;
+  LineReader(const LineReader & disabled_copy_constructor);
+  LineReader & operator=(const LineReader & disabled_assignment_operator);
+};
+
 enum class Dir : unsigned int {
   left = 0, right = 1
 };